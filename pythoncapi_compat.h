@@ -235,12 +235,91 @@ static inline int PyFrame_GetLasti(PyFrameObject *frame)
 #endif
 
 
+// On Python 3.6-3.10, read a variable of an optimized frame directly in its
+// fast locals, without creating the frame locals dictionary. Python 3.11 made
+// the PyFrameObject structure opaque.
+#if 0x03060000 <= PY_VERSION_HEX && PY_VERSION_HEX < 0x030B0000 && !defined(PYPY_VERSION)
+#  define _PYTHONCAPI_COMPAT_FRAME_FAST_LOCALS
+
+// Get the index of the variable 'name' in the fast locals of 'code'.
+// Return -1 if the variable is not found.
+static inline Py_ssize_t
+_PyCode_GetFastLocalIndex(PyCodeObject *code, PyObject *name)
+{
+    // Cell variables are checked before local variables: the local variable
+    // of an argument stored in a cell is cleared.
+    PyObject *tuples[3];
+    Py_ssize_t offsets[3];
+    Py_ssize_t i, j;
+    int pass;
+
+    tuples[0] = code->co_cellvars;
+    offsets[0] = code->co_nlocals;
+    tuples[1] = code->co_varnames;
+    offsets[1] = 0;
+    tuples[2] = code->co_freevars;
+    offsets[2] = code->co_nlocals + PyTuple_GET_SIZE(code->co_cellvars);
+
+    // Variable names are interned: first compare pointers
+    for (pass=0; pass < 2; pass++) {
+        for (i=0; i < 3; i++) {
+            PyObject *names = tuples[i];
+            for (j=0; j < PyTuple_GET_SIZE(names); j++) {
+                PyObject *item = PyTuple_GET_ITEM(names, j);
+                if (item == name
+                    || (pass == 1 && PyUnicode_Compare(item, name) == 0))
+                {
+                    return offsets[i] + j;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+// Get a borrowed reference to the value of the fast local 'index' of 'frame'.
+// Return NULL if the variable is unbound.
+static inline PyObject*
+_PyFrame_GetFastLocal(PyFrameObject *frame, Py_ssize_t index)
+{
+    PyObject *value = frame->f_localsplus[index];
+    if (index >= frame->f_code->co_nlocals && value != _Py_NULL) {
+        // cell or free variable
+        value = PyCell_GET(value);
+    }
+    return value;
+}
+
+// Return 1 if the variables of 'frame' can be read in its fast locals.
+static inline int
+_PyFrame_HasFastLocals(PyFrameObject *frame, PyObject *name)
+{
+    return ((frame->f_code->co_flags & CO_OPTIMIZED)
+            && PyUnicode_CheckExact(name));
+}
+#endif
+
 // gh-91248 added PyFrame_GetVar() to Python 3.12.0a2
 #if PY_VERSION_HEX < 0x030C00A2 && !defined(PYPY_VERSION)
 static inline PyObject* PyFrame_GetVar(PyFrameObject *frame, PyObject *name)
 {
     PyObject *locals, *value;
 
+#ifdef _PYTHONCAPI_COMPAT_FRAME_FAST_LOCALS
+    if (_PyFrame_HasFastLocals(frame, name)) {
+        Py_ssize_t index = _PyCode_GetFastLocalIndex(frame->f_code, name);
+        value = _Py_NULL;
+        if (index >= 0) {
+            value = _PyFrame_GetFastLocal(frame, index);
+        }
+        if (value == _Py_NULL) {
+            PyErr_Format(PyExc_NameError, "variable %R does not exist", name);
+            return _Py_NULL;
+        }
+        return Py_NewRef(value);
+    }
+#endif
+
     locals = PyFrame_GetLocals(frame);
     if (locals == NULL) {
         return NULL;
@@ -289,6 +368,72 @@ PyFrame_GetVarString(PyFrameObject *frame, const char *name)
 #endif
 
 
+#if !defined(PYPY_VERSION)
+// Per-call-site cache of the fast local index of a frame variable: see
+// _PyFrame_GetVarCached(). Must be zero-initialized.
+typedef struct {
+    PyCodeObject *code;        // strong reference
+    PyObject *name;            // strong reference
+    Py_ssize_t index;
+} _PyFrame_VarCache;
+
+static inline void
+_PyFrame_VarCache_Clear(_PyFrame_VarCache *cache)
+{
+    PyCodeObject *code = cache->code;
+    PyObject *name = cache->name;
+    cache->code = _Py_NULL;
+    cache->name = _Py_NULL;
+    cache->index = 0;
+    Py_XDECREF(code);
+    Py_XDECREF(name);
+}
+
+// Similar to PyFrame_GetVar(), but cache the index of the variable in the
+// fast locals per code object in 'cache'. Only use the cache on Python
+// 3.6-3.10.
+//
+// The cache must be zero-initialized. It keeps strong references to the last
+// code object and name: release them with _PyFrame_VarCache_Clear().
+static inline PyObject*
+_PyFrame_GetVarCached(_PyFrame_VarCache *cache, PyFrameObject *frame,
+                      PyObject *name)
+{
+#ifdef _PYTHONCAPI_COMPAT_FRAME_FAST_LOCALS
+    PyCodeObject *code = frame->f_code;
+    PyObject *value;
+
+    if (!_PyFrame_HasFastLocals(frame, name)) {
+        return PyFrame_GetVar(frame, name);
+    }
+    if (cache->code != code || cache->name != name) {
+        PyCodeObject *old_code = cache->code;
+        PyObject *old_name = cache->name;
+        Py_ssize_t index = _PyCode_GetFastLocalIndex(code, name);
+        if (index < 0) {
+            return PyFrame_GetVar(frame, name);
+        }
+        cache->code = _Py_CAST(PyCodeObject*, Py_NewRef(code));
+        cache->name = Py_NewRef(name);
+        cache->index = index;
+        Py_XDECREF(old_code);
+        Py_XDECREF(old_name);
+    }
+
+    value = _PyFrame_GetFastLocal(frame, cache->index);
+    if (value == _Py_NULL) {
+        PyErr_Format(PyExc_NameError, "variable %R does not exist", name);
+        return _Py_NULL;
+    }
+    return Py_NewRef(value);
+#else
+    (void)cache;
+    return PyFrame_GetVar(frame, name);
+#endif
+}
+#endif
+
+
 // bpo-39947 added PyThreadState_GetInterpreter() to Python 3.9.0a5
 #if PY_VERSION_HEX < 0x030900A5 || (defined(PYPY_VERSION) && PY_VERSION_HEX < 0x030B0000)
 static inline PyInterpreterState *
@@ -320,6 +465,61 @@ _PyThreadState_GetFrameBorrow(PyThreadState *tstate)
 #endif
 
 
+#if !defined(PYPY_VERSION)
+// Frame of a stack sample: see _PyThreadState_GetStackSamples()
+typedef struct {
+    PyCodeObject *code;        // borrowed reference
+    int lasti;
+} _PyFrameSample;
+
+// Walk the frames of 'tstate', from the innermost frame to the outermost
+// frame, and fill 'samples' with (code, lasti) pairs. Write at most
+// 'max_samples' samples and return the number of written samples.
+//
+// Code objects are borrowed references: they are only valid while the frames
+// are alive. The caller must hold the GIL (or be attached to 'tstate' on the
+// free-threaded build), and no exception must be set.
+//
+// On Python 3.10 and older, the function reads the frame members directly
+// and cannot fail. On Python 3.11 and newer, frames are only reachable through
+// the public frame API: PyThreadState_GetFrame() and PyFrame_GetBack() create
+// a frame object for each frame which has none yet, and the function does an
+// INCREF/DECREF pair per frame and per sample. Creating a frame object can
+// fail: set an exception and return -1 in this case.
+static inline Py_ssize_t
+_PyThreadState_GetStackSamples(PyThreadState *tstate, _PyFrameSample *samples,
+                               Py_ssize_t max_samples)
+{
+    Py_ssize_t n = 0;
+    PyFrameObject *frame;
+
+    assert(tstate != _Py_NULL);
+#if PY_VERSION_HEX < 0x030B0000
+    // Read directly the PyFrameObject members
+    frame = tstate->frame;
+    while (frame != _Py_NULL && n < max_samples) {
+        samples[n].code = frame->f_code;
+        samples[n].lasti = PyFrame_GetLasti(frame);
+        n++;
+        frame = frame->f_back;
+    }
+#else
+    frame = _PyThreadState_GetFrameBorrow(tstate);
+    while (frame != _Py_NULL && n < max_samples) {
+        samples[n].code = _PyFrame_GetCodeBorrow(frame);
+        samples[n].lasti = PyFrame_GetLasti(frame);
+        n++;
+        frame = _PyFrame_GetBackBorrow(frame);
+    }
+    if (frame == _Py_NULL && PyErr_Occurred()) {
+        return -1;
+    }
+#endif
+    return n;
+}
+#endif
+
+
 // bpo-39947 added PyInterpreterState_Get() to Python 3.9.0a5
 #if PY_VERSION_HEX < 0x030900A5 || defined(PYPY_VERSION)
 static inline PyInterpreterState* PyInterpreterState_Get(void)
@@ -543,6 +743,402 @@ static inline PyObject* PyCode_GetCellvars(PyCodeObject *code)
 #endif
 
 
+// gh-101101 added PyUnstable_Eval_RequestCodeExtraIndex(),
+// PyUnstable_Code_GetExtra() and PyUnstable_Code_SetExtra() to Python
+// 3.12.0a6
+#if 0x030600B1 <= PY_VERSION_HEX && PY_VERSION_HEX < 0x030C00A6 && !defined(PYPY_VERSION)
+static inline Py_ssize_t
+PyUnstable_Eval_RequestCodeExtraIndex(freefunc free)
+{
+    return _PyEval_RequestCodeExtraIndex(free);
+}
+
+static inline int
+PyUnstable_Code_GetExtra(PyObject *code, Py_ssize_t index, void **extra)
+{
+    return _PyCode_GetExtra(code, index, extra);
+}
+
+static inline int
+PyUnstable_Code_SetExtra(PyObject *code, Py_ssize_t index, void *extra)
+{
+    return _PyCode_SetExtra(code, index, extra);
+}
+#endif
+
+
+// Data cached per code object, such as the line number table used by
+// _PyCode_Addr2LineCached(). The data is stored in the code object extra
+// storage (PEP 523) and so is freed with the code object.
+#if PY_VERSION_HEX >= 0x030600B1 && !defined(PYPY_VERSION) && !defined(Py_GIL_DISABLED)
+#  define _PYTHONCAPI_COMPAT_CODE_EXTRA
+
+typedef struct {
+    int start;
+    int end;
+    int line;
+} _PyCodeLineEntry;
+
+typedef struct {
+    Py_ssize_t size;
+    _PyCodeLineEntry entries[1];
+} _PyCodeLineTable;
+
+static inline int
+_PyCodeLineTable_Add(_PyCodeLineTable **ptable, Py_ssize_t *allocated,
+                     int start, int end, int line)
+{
+    _PyCodeLineTable *table = *ptable;
+    _PyCodeLineEntry *entry;
+
+    // Python 3.6-3.9 line number table can have multiple entries for the same
+    // offset: the last one wins
+    if (table->size > 0
+        && table->entries[table->size - 1].start == start)
+    {
+        entry = &table->entries[table->size - 1];
+        entry->end = end;
+        entry->line = line;
+        return 0;
+    }
+
+    if (table->size == *allocated) {
+        Py_ssize_t new_allocated = *allocated * 2;
+        size_t size = sizeof(_PyCodeLineTable)
+                      + (size_t)(new_allocated - 1) * sizeof(_PyCodeLineEntry);
+        table = _Py_CAST(_PyCodeLineTable*, PyMem_Realloc(table, size));
+        if (table == _Py_NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        *ptable = table;
+        *allocated = new_allocated;
+    }
+    entry = &table->entries[table->size];
+    entry->start = start;
+    entry->end = end;
+    entry->line = line;
+    table->size++;
+    return 0;
+}
+
+// Build the sorted table of (start, end, line) entries of a code object
+static inline _PyCodeLineTable*
+_PyCodeLineTable_New(PyCodeObject *code)
+{
+    Py_ssize_t allocated = 16;
+    size_t size = sizeof(_PyCodeLineTable)
+                  + (size_t)(allocated - 1) * sizeof(_PyCodeLineEntry);
+    _PyCodeLineTable *table;
+
+    table = _Py_CAST(_PyCodeLineTable*, PyMem_Malloc(size));
+    if (table == _Py_NULL) {
+        PyErr_NoMemory();
+        return _Py_NULL;
+    }
+    table->size = 0;
+
+#if PY_VERSION_HEX >= 0x030A0000
+    // bpo-43933 added code.co_lines() to Python 3.10
+    {
+        PyObject *lines, *item;
+        lines = PyObject_CallMethod(_PyObject_CAST(code), "co_lines", _Py_NULL);
+        if (lines == _Py_NULL) {
+            goto error;
+        }
+        while ((item = PyIter_Next(lines)) != _Py_NULL) {
+            int start, end, line;
+            PyObject *line_obj;
+            if (!PyArg_ParseTuple(item, "iiO", &start, &end, &line_obj)) {
+                Py_DECREF(item);
+                Py_DECREF(lines);
+                goto error;
+            }
+            if (line_obj == Py_None) {
+                line = -1;
+            }
+            else {
+                line = _Py_CAST(int, PyLong_AsLong(line_obj));
+            }
+            Py_DECREF(item);
+            if (line == -1 && PyErr_Occurred()) {
+                Py_DECREF(lines);
+                goto error;
+            }
+            if (start < end
+                && _PyCodeLineTable_Add(&table, &allocated,
+                                        start, end, line) < 0) {
+                Py_DECREF(lines);
+                goto error;
+            }
+        }
+        Py_DECREF(lines);
+        if (PyErr_Occurred()) {
+            goto error;
+        }
+    }
+#else
+    // Decode co_lnotab: see PyCode_Addr2Line() of Python 3.6-3.9
+    {
+        const unsigned char *lnotab;
+        Py_ssize_t i, lnotab_size;
+        int addr = 0;
+        int line = code->co_firstlineno;
+
+        lnotab = _Py_CAST(const unsigned char*, PyBytes_AS_STRING(code->co_lnotab));
+        lnotab_size = PyBytes_GET_SIZE(code->co_lnotab) / 2;
+        if (_PyCodeLineTable_Add(&table, &allocated, addr, INT_MAX, line) < 0) {
+            goto error;
+        }
+        for (i=0; i < lnotab_size; i++) {
+            addr += lnotab[i * 2];
+            line += _Py_CAST(signed char, lnotab[i * 2 + 1]);
+            if (table->entries[table->size - 1].start != addr) {
+                table->entries[table->size - 1].end = addr;
+            }
+            if (_PyCodeLineTable_Add(&table, &allocated, addr, INT_MAX, line) < 0) {
+                goto error;
+            }
+        }
+    }
+#endif
+    return table;
+
+error:
+    PyMem_Free(table);
+    return _Py_NULL;
+}
+
+// Data attached to a code object in its extra storage
+typedef struct {
+    _PyCodeLineTable *line_table;
+    PyObject *code;            // strong reference
+    PyObject *varnames;        // strong reference
+    PyObject *cellvars;        // strong reference
+    PyObject *freevars;        // strong reference
+} _PyCodeExtra;
+
+static inline void
+_PyCodeExtra_Free(void *ptr)
+{
+    _PyCodeExtra *extra = _Py_CAST(_PyCodeExtra*, ptr);
+    // Called with NULL if the code object has no data for this index
+    if (extra == _Py_NULL) {
+        return;
+    }
+    PyMem_Free(extra->line_table);
+    Py_XDECREF(extra->code);
+    Py_XDECREF(extra->varnames);
+    Py_XDECREF(extra->cellvars);
+    Py_XDECREF(extra->freevars);
+    PyMem_Free(extra);
+}
+
+// Get the data attached to a code object, or attach new data.
+// Set an exception and return NULL on error.
+static inline _PyCodeExtra*
+_PyCode_GetExtraCache(PyCodeObject *code)
+{
+    // The extra index is specific to an interpreter. Static variables of a
+    // static inline function are specific to a translation unit: each C file
+    // using the cache requests its own index.
+    static PyInterpreterState *index_interp = _Py_NULL;
+    static Py_ssize_t index = -1;
+    PyInterpreterState *interp = PyInterpreterState_Get();
+    _PyCodeExtra *extra;
+    void *ptr;
+
+    if (index_interp == _Py_NULL) {
+        index = PyUnstable_Eval_RequestCodeExtraIndex(_PyCodeExtra_Free);
+        if (index < 0) {
+            // The function doesn't set an exception
+            PyErr_SetString(PyExc_RuntimeError,
+                            "no code object extra index available");
+            return _Py_NULL;
+        }
+        index_interp = interp;
+    }
+    else if (index_interp != interp) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "code object cache is not available "
+                        "in this interpreter");
+        return _Py_NULL;
+    }
+
+    if (PyUnstable_Code_GetExtra(_PyObject_CAST(code), index, &ptr) < 0) {
+        return _Py_NULL;
+    }
+    if (ptr != _Py_NULL) {
+        return _Py_CAST(_PyCodeExtra*, ptr);
+    }
+
+    extra = _Py_CAST(_PyCodeExtra*, PyMem_Calloc(1, sizeof(_PyCodeExtra)));
+    if (extra == _Py_NULL) {
+        PyErr_NoMemory();
+        return _Py_NULL;
+    }
+    if (PyUnstable_Code_SetExtra(_PyObject_CAST(code), index, extra) < 0) {
+        PyMem_Free(extra);
+        return _Py_NULL;
+    }
+    return extra;
+}
+
+// Get the line table of a code object, or create it.
+// Return NULL if the table cannot be created or stored: no error is set.
+static inline _PyCodeLineTable*
+_PyCode_GetLineTable(PyCodeObject *code)
+{
+    _PyCodeExtra *extra = _PyCode_GetExtraCache(code);
+    if (extra == _Py_NULL) {
+        PyErr_Clear();
+        return _Py_NULL;
+    }
+    if (extra->line_table == _Py_NULL) {
+        extra->line_table = _PyCodeLineTable_New(code);
+        if (extra->line_table == _Py_NULL) {
+            PyErr_Clear();
+        }
+    }
+    return extra->line_table;
+}
+#endif
+
+#if !defined(PYPY_VERSION)
+// Similar to PyCode_Addr2Line(), but decode the line number table only once
+// per code object and cache it as a sorted array of offset ranges: look up
+// the line number with a binary search.
+//
+// The function cannot fail: fall back to PyCode_Addr2Line() if the cache
+// cannot be used.
+static inline int
+_PyCode_Addr2LineCached(PyCodeObject *code, int addrq)
+{
+#ifdef _PYTHONCAPI_COMPAT_CODE_EXTRA
+    _PyCodeLineTable *table;
+    Py_ssize_t low, high;
+
+    // Don't build the table if an exception is set, since building it can
+    // clear the exception
+    if (addrq < 0 || PyErr_Occurred()) {
+        return PyCode_Addr2Line(code, addrq);
+    }
+
+    table = _PyCode_GetLineTable(code);
+    if (table == _Py_NULL) {
+        return PyCode_Addr2Line(code, addrq);
+    }
+
+    // Find the last entry with start <= addrq
+    low = 0;
+    high = table->size;
+    while (low < high) {
+        Py_ssize_t mid = low + (high - low) / 2;
+        if (table->entries[mid].start <= addrq) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    if (low == 0 || addrq >= table->entries[low - 1].end) {
+        return -1;
+    }
+    return table->entries[low - 1].line;
+#else
+    return PyCode_Addr2Line(code, addrq);
+#endif
+}
+#endif
+
+
+#if !defined(PYPY_VERSION)
+#if PY_VERSION_HEX >= 0x030B0000 && PY_VERSION_HEX < 0x030C0000
+// Get a borrowed reference to the result of getter(code), cached in the
+// member at 'offset' of the code object extra data.
+static inline PyObject*
+_PyCode_GetCachedBorrow(PyCodeObject *code, size_t offset,
+                        PyObject* (*getter)(PyCodeObject *code))
+{
+    _PyCodeExtra *extra = _PyCode_GetExtraCache(code);
+    PyObject **cached;
+    if (extra == _Py_NULL) {
+        return _Py_NULL;
+    }
+    cached = _Py_CAST(PyObject**, _Py_CAST(char*, extra) + offset);
+    if (*cached == _Py_NULL) {
+        *cached = getter(code);
+    }
+    return *cached;
+}
+#endif
+
+// Similar to PyCode_GetCode(), PyCode_GetVarnames(), PyCode_GetCellvars() and
+// PyCode_GetFreevars(), but return a borrowed reference. The result is cached
+// in the code object: it is only computed once per code object.
+//
+// - Python 3.10 and older: return the code object member.
+// - Python 3.11: cache the result in the code object extra storage.
+// - Python 3.12 and newer: PyCode_GetCode() and others cache their result in
+//   the code object.
+static inline PyObject* _PyCode_GetCodeBorrow(PyCodeObject *code)
+{
+#if PY_VERSION_HEX < 0x030B0000
+    return code->co_code;
+#elif PY_VERSION_HEX < 0x030C0000
+    return _PyCode_GetCachedBorrow(code, offsetof(_PyCodeExtra, code),
+                                   PyCode_GetCode);
+#else
+    PyObject *value = PyCode_GetCode(code);
+    Py_XDECREF(value);
+    return value;
+#endif
+}
+
+static inline PyObject* _PyCode_GetVarnamesBorrow(PyCodeObject *code)
+{
+#if PY_VERSION_HEX < 0x030B0000
+    return code->co_varnames;
+#elif PY_VERSION_HEX < 0x030C0000
+    return _PyCode_GetCachedBorrow(code, offsetof(_PyCodeExtra, varnames),
+                                   PyCode_GetVarnames);
+#else
+    PyObject *value = PyCode_GetVarnames(code);
+    Py_XDECREF(value);
+    return value;
+#endif
+}
+
+static inline PyObject* _PyCode_GetCellvarsBorrow(PyCodeObject *code)
+{
+#if PY_VERSION_HEX < 0x030B0000
+    return code->co_cellvars;
+#elif PY_VERSION_HEX < 0x030C0000
+    return _PyCode_GetCachedBorrow(code, offsetof(_PyCodeExtra, cellvars),
+                                   PyCode_GetCellvars);
+#else
+    PyObject *value = PyCode_GetCellvars(code);
+    Py_XDECREF(value);
+    return value;
+#endif
+}
+
+static inline PyObject* _PyCode_GetFreevarsBorrow(PyCodeObject *code)
+{
+#if PY_VERSION_HEX < 0x030B0000
+    return code->co_freevars;
+#elif PY_VERSION_HEX < 0x030C0000
+    return _PyCode_GetCachedBorrow(code, offsetof(_PyCodeExtra, freevars),
+                                   PyCode_GetFreevars);
+#else
+    PyObject *value = PyCode_GetFreevars(code);
+    Py_XDECREF(value);
+    return value;
+#endif
+}
+#endif
+
+
 // Py_UNUSED() was added to Python 3.4.0b2.
 #if PY_VERSION_HEX < 0x030400B2 && !defined(Py_UNUSED)
 #  if defined(__GNUC__) || defined(__clang__)
@@ -582,11 +1178,46 @@ static inline int PyWeakref_GetRef(PyObject *ref, PyObject **pobj)
         *pobj = NULL;
         return 0;
     }
+    // Similar to _Py_TryIncref() of Python 3.13: don't resurrect an object
+    // which is being deallocated but whose weak references are not cleared
+    // yet.
+    if (Py_REFCNT(obj) <= 0) {
+        *pobj = NULL;
+        return 0;
+    }
     *pobj = Py_NewRef(obj);
     return 1;
 }
 #endif
 
+// Dereference an array of weak references: call PyWeakref_GetRef() on each
+// item of 'refs' and store the strong references in 'objs' (NULL for dead
+// referents).
+//
+// Return the number of alive referents. On error, set all 'objs' items to
+// NULL, set an exception and return -1.
+static inline Py_ssize_t
+_PyWeakref_GetRefs(PyObject *const *refs, Py_ssize_t size, PyObject **objs)
+{
+    Py_ssize_t i, alive = 0;
+
+    for (i=0; i < size; i++) {
+        int res = PyWeakref_GetRef(refs[i], &objs[i]);
+        if (res < 0) {
+            while (i > 0) {
+                i--;
+                Py_CLEAR(objs[i]);
+            }
+            for (i=0; i < size; i++) {
+                objs[i] = _Py_NULL;
+            }
+            return -1;
+        }
+        alive += res;
+    }
+    return alive;
+}
+
 
 // bpo-36974 added PY_VECTORCALL_ARGUMENTS_OFFSET to Python 3.8b1
 #ifndef PY_VECTORCALL_ARGUMENTS_OFFSET
@@ -602,27 +1233,21 @@ static inline Py_ssize_t PyVectorcall_NARGS(size_t n)
 #endif
 
 
-// gh-105922 added PyObject_Vectorcall() to Python 3.9.0a4
-#if PY_VERSION_HEX < 0x030900A4
-static inline PyObject*
-PyObject_Vectorcall(PyObject *callable, PyObject *const *args,
-                     size_t nargsf, PyObject *kwnames)
+// Convert vectorcall arguments to an arguments tuple and a keyword arguments
+// dict, in a single pass over args. Set *kwargs to NULL if there is no keyword
+// argument. Useful to call a tp_call function from a vectorcall function.
+static inline int
+_PyVectorcall_PackArgs(PyObject *const *args, size_t nargsf, PyObject *kwnames,
+                       PyObject **posargs, PyObject **kwargs)
 {
-#if PY_VERSION_HEX >= 0x030800B1 && !defined(PYPY_VERSION)
-    // bpo-36974 added _PyObject_Vectorcall() to Python 3.8.0b1
-    return _PyObject_Vectorcall(callable, args, nargsf, kwnames);
-#else
-    PyObject *posargs = NULL, *kwargs = NULL;
-    PyObject *res;
     Py_ssize_t nposargs, nkwargs, i;
 
-    if (nargsf != 0 && args == NULL) {
-        PyErr_BadInternalCall();
-        goto error;
-    }
+    *posargs = NULL;
+    *kwargs = NULL;
+
     if (kwnames != NULL && !PyTuple_Check(kwnames)) {
         PyErr_BadInternalCall();
-        goto error;
+        return -1;
     }
 
     nposargs = (Py_ssize_t)PyVectorcall_NARGS(nargsf);
@@ -632,50 +1257,257 @@ PyObject_Vectorcall(PyObject *callable, PyObject *const *args,
     else {
         nkwargs = 0;
     }
+    if ((nposargs != 0 || nkwargs != 0) && args == NULL) {
+        PyErr_BadInternalCall();
+        return -1;
+    }
 
-    posargs = PyTuple_New(nposargs);
-    if (posargs == NULL) {
-        goto error;
+    *posargs = PyTuple_New(nposargs);
+    if (*posargs == NULL) {
+        return -1;
     }
-    if (nposargs) {
-        for (i=0; i < nposargs; i++) {
-            PyTuple_SET_ITEM(posargs, i, Py_NewRef(*args));
-            args++;
-        }
+    for (i=0; i < nposargs; i++) {
+        PyTuple_SET_ITEM(*posargs, i, Py_NewRef(args[i]));
     }
 
     if (nkwargs) {
-        kwargs = PyDict_New();
-        if (kwargs == NULL) {
+        *kwargs = PyDict_New();
+        if (*kwargs == NULL) {
             goto error;
         }
 
+        args += nposargs;
         for (i = 0; i < nkwargs; i++) {
             PyObject *key = PyTuple_GET_ITEM(kwnames, i);
-            PyObject *value = *args;
-            args++;
-            if (PyDict_SetItem(kwargs, key, value) < 0) {
+            if (PyDict_SetItem(*kwargs, key, args[i]) < 0) {
                 goto error;
             }
         }
     }
-    else {
-        kwargs = NULL;
+    return 0;
+
+error:
+    Py_CLEAR(*posargs);
+    Py_CLEAR(*kwargs);
+    return -1;
+}
+
+
+// gh-105922 added PyObject_Vectorcall() to Python 3.9.0a4
+#if PY_VERSION_HEX < 0x030900A4
+static inline PyObject*
+PyObject_Vectorcall(PyObject *callable, PyObject *const *args,
+                     size_t nargsf, PyObject *kwnames)
+{
+#if PY_VERSION_HEX >= 0x030800B1 && !defined(PYPY_VERSION)
+    // bpo-36974 added _PyObject_Vectorcall() to Python 3.8.0b1
+    return _PyObject_Vectorcall(callable, args, nargsf, kwnames);
+#elif PY_VERSION_HEX >= 0x030600B1 && !defined(PYPY_VERSION)
+    // bpo-27830 added _PyObject_FastCallKeywords() to Python 3.6.0b1.
+    // It calls METH_FASTCALL functions and Python functions without creating
+    // an arguments tuple.
+    if (kwnames != NULL && !PyTuple_Check(kwnames)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    return _PyObject_FastCallKeywords(callable,
+                                      _Py_CAST(PyObject**, args),
+                                      PyVectorcall_NARGS(nargsf),
+                                      kwnames);
+#else
+    PyObject *posargs, *kwargs;
+    PyObject *res;
+
+    if (_PyVectorcall_PackArgs(args, nargsf, kwnames, &posargs, &kwargs) < 0) {
+        return NULL;
     }
 
     res = PyObject_Call(callable, posargs, kwargs);
     Py_DECREF(posargs);
     Py_XDECREF(kwargs);
     return res;
+#endif
+}
+#endif
 
-error:
-    Py_DECREF(posargs);
-    Py_XDECREF(kwargs);
-    return NULL;
+
+// bpo-39245 added PyObject_VectorcallMethod() to Python 3.9.0a4
+#if PY_VERSION_HEX < 0x030900A4
+static inline PyObject*
+PyObject_VectorcallMethod(PyObject *name, PyObject *const *args,
+                          size_t nargsf, PyObject *kwnames)
+{
+    PyObject *method, *res;
+
+    assert(name != NULL);
+    assert(args != NULL);
+    assert(PyVectorcall_NARGS(nargsf) >= 1);
+
+    method = PyObject_GetAttr(args[0], name);
+    if (method == NULL) {
+        return NULL;
+    }
+    // Skip "self". Keep PY_VECTORCALL_ARGUMENTS_OFFSET since args[-1] in the
+    // onward call is args[0] here.
+    res = PyObject_Vectorcall(method, args + 1, nargsf - 1, kwnames);
+    Py_DECREF(method);
+    return res;
+}
+#endif
+
+
+// Per-call-site cache of an unbound method: see
+// _PyObject_VectorcallMethodCached(). Must be zero-initialized.
+typedef struct {
+    PyTypeObject *type;        // strong reference
+    unsigned int version_tag;
+    PyObject *name;            // strong reference
+    PyObject *method;          // strong reference
+} _PyObject_MethodCache;
+
+static inline void
+_PyObject_MethodCache_Clear(_PyObject_MethodCache *cache)
+{
+    PyTypeObject *type = cache->type;
+    PyObject *name = cache->name;
+    PyObject *method = cache->method;
+    cache->type = _Py_NULL;
+    cache->version_tag = 0;
+    cache->name = _Py_NULL;
+    cache->method = _Py_NULL;
+    Py_XDECREF(type);
+    Py_XDECREF(name);
+    Py_XDECREF(method);
+}
+
+// Per-type caches rely on the type version tag and on the GIL to serialize
+// cache updates.
+#if PY_VERSION_HEX >= 0x03000000 && !defined(PYPY_VERSION) && !defined(Py_GIL_DISABLED)
+#  define _PYTHONCAPI_COMPAT_TYPE_CACHE
+#endif
+
+#ifdef _PYTHONCAPI_COMPAT_TYPE_CACHE
+// Python 3.13 no longer uses Py_TPFLAGS_VALID_VERSION_TAG: a non-zero version
+// tag is valid.
+#if PY_VERSION_HEX >= 0x030D0000
+#  define _PyType_HasValidVersionTag(type) ((type)->tp_version_tag != 0)
+#else
+#  define _PyType_HasValidVersionTag(type) \
+    ((type)->tp_version_tag != 0 \
+     && PyType_HasFeature((type), Py_TPFLAGS_VALID_VERSION_TAG))
+#endif
+
+// Get the unbound method 'name' of 'obj' from the cache, or fill the cache.
+// Return a borrowed reference, or NULL if the method cannot be cached or if
+// an error occurred: use PyErr_Occurred() to distinguish the two cases.
+static inline PyObject*
+_PyObject_MethodCache_Lookup(_PyObject_MethodCache *cache, PyObject *obj,
+                             PyObject *name)
+{
+    PyTypeObject *type = Py_TYPE(obj);
+    PyObject *descr;
+
+    if (type->tp_getattro != PyObject_GenericGetAttr) {
+        return _Py_NULL;
+    }
+#ifdef Py_TPFLAGS_MANAGED_DICT
+    if (PyType_HasFeature(type, Py_TPFLAGS_MANAGED_DICT)) {
+        return _Py_NULL;
+    }
+#endif
+
+    if (cache->type == type
+        && cache->name == name
+        && cache->version_tag != 0
+        && type->tp_version_tag == cache->version_tag
+        && _PyType_HasValidVersionTag(type))
+    {
+        descr = cache->method;
+    }
+    else {
+        descr = _PyType_Lookup(type, name);
+        if (descr == _Py_NULL) {
+            return _Py_NULL;
+        }
+        // bpo-37151 added Py_TPFLAGS_METHOD_DESCRIPTOR to Python 3.8.0b1
+#ifdef Py_TPFLAGS_METHOD_DESCRIPTOR
+        if (!PyType_HasFeature(Py_TYPE(descr), Py_TPFLAGS_METHOD_DESCRIPTOR)) {
+            return _Py_NULL;
+        }
+#else
+        if (!PyFunction_Check(descr) && !Py_IS_TYPE(descr, &PyMethodDescr_Type)) {
+            return _Py_NULL;
+        }
 #endif
+        // _PyType_Lookup() assigns a version tag if possible
+        if (_PyType_HasValidVersionTag(type)) {
+            PyTypeObject *old_type = cache->type;
+            PyObject *old_name = cache->name;
+            PyObject *old_method = cache->method;
+            cache->type = _Py_CAST(PyTypeObject*, Py_NewRef(type));
+            cache->version_tag = type->tp_version_tag;
+            cache->name = Py_NewRef(name);
+            cache->method = Py_NewRef(descr);
+            Py_XDECREF(old_type);
+            Py_XDECREF(old_name);
+            Py_XDECREF(old_method);
+        }
+    }
+
+    // An instance attribute shadows the method
+    if (type->tp_dictoffset != 0) {
+        PyObject **dictptr = _PyObject_GetDictPtr(obj);
+        if (dictptr != _Py_NULL && *dictptr != _Py_NULL) {
+            if (PyDict_GetItemWithError(*dictptr, name) != _Py_NULL) {
+                return _Py_NULL;
+            }
+            if (PyErr_Occurred()) {
+                return _Py_NULL;
+            }
+        }
+    }
+    return descr;
 }
 #endif
 
+// Similar to PyObject_VectorcallMethod(), but cache the unbound method per
+// type in 'cache', keyed by the type version tag. If the method is cached, the
+// method is called without getting a bound method. Otherwise, fall back to
+// PyObject_VectorcallMethod().
+//
+// The cache must be zero-initialized. It keeps strong references to the last
+// type, name and method: release them with _PyObject_MethodCache_Clear().
+static inline PyObject*
+_PyObject_VectorcallMethodCached(_PyObject_MethodCache *cache, PyObject *name,
+                                 PyObject *const *args, size_t nargsf,
+                                 PyObject *kwnames)
+{
+#ifdef _PYTHONCAPI_COMPAT_TYPE_CACHE
+    PyObject *method, *res;
+
+    assert(args != NULL);
+    assert(PyVectorcall_NARGS(nargsf) >= 1);
+
+    method = _PyObject_MethodCache_Lookup(cache, args[0], name);
+    if (method != _Py_NULL) {
+        // Hold a strong reference: the call can clear the cache
+        Py_INCREF(method);
+        // args[-1] must not be overridden: args[0] is self
+        res = PyObject_Vectorcall(method, args,
+                                  nargsf & ~PY_VECTORCALL_ARGUMENTS_OFFSET,
+                                  kwnames);
+        Py_DECREF(method);
+        return res;
+    }
+    if (PyErr_Occurred()) {
+        return _Py_NULL;
+    }
+#else
+    (void)cache;
+#endif
+    return PyObject_VectorcallMethod(name, args, nargsf, kwnames);
+}
+
 
 // gh-106521 added PyObject_GetOptionalAttr() and
 // PyObject_GetOptionalAttrString() to Python 3.13.0a1
@@ -710,17 +1542,157 @@ PyObject_GetOptionalAttrString(PyObject *obj, const char *attr_name, PyObject **
 #if PY_VERSION_HEX >= 0x03000000
     name_obj = PyUnicode_FromString(attr_name);
 #else
-    name_obj = PyString_FromString(attr_name);
+    name_obj = PyString_FromString(attr_name);
+#endif
+    if (name_obj == NULL) {
+        *result = NULL;
+        return -1;
+    }
+    rc = PyObject_GetOptionalAttr(obj, name_obj, result);
+    Py_DECREF(name_obj);
+    return rc;
+}
+#endif
+
+
+// Per-call-site cache of a type attribute: see
+// _PyObject_GetOptionalAttrCached(). Must be zero-initialized.
+typedef struct {
+    PyTypeObject *type;        // strong reference
+    unsigned int version_tag;
+    PyObject *name;            // strong reference
+    PyObject *descr;           // strong reference, NULL if not found
+} _PyObject_AttrCache;
+
+static inline void
+_PyObject_AttrCache_Clear(_PyObject_AttrCache *cache)
+{
+    PyTypeObject *type = cache->type;
+    PyObject *name = cache->name;
+    PyObject *descr = cache->descr;
+    cache->type = _Py_NULL;
+    cache->version_tag = 0;
+    cache->name = _Py_NULL;
+    cache->descr = _Py_NULL;
+    Py_XDECREF(type);
+    Py_XDECREF(name);
+    Py_XDECREF(descr);
+}
+
+// Similar to PyObject_GetOptionalAttr(), but cache the result of the type
+// lookup (the descriptor or the class attribute, or its absence) per type in
+// 'cache', keyed by the type version tag. The instance dictionary is still
+// checked. Fall back to PyObject_GetOptionalAttr() if the type does not use
+// the generic attribute lookup.
+//
+// The cache must be zero-initialized. It keeps strong references to the last
+// type, name and descriptor: release them with _PyObject_AttrCache_Clear().
+static inline int
+_PyObject_GetOptionalAttrCached(_PyObject_AttrCache *cache, PyObject *obj,
+                                PyObject *name, PyObject **result)
+{
+#ifdef _PYTHONCAPI_COMPAT_TYPE_CACHE
+    PyTypeObject *type = Py_TYPE(obj);
+    PyObject *descr;
+    descrgetfunc get = _Py_NULL;
+
+    if (type->tp_getattro != PyObject_GenericGetAttr
+        || !PyUnicode_CheckExact(name))
+    {
+        goto fallback;
+    }
+#ifdef Py_TPFLAGS_MANAGED_DICT
+    if (PyType_HasFeature(type, Py_TPFLAGS_MANAGED_DICT)) {
+        goto fallback;
+    }
+#endif
+
+    if (cache->type == type
+        && cache->name == name
+        && cache->version_tag != 0
+        && type->tp_version_tag == cache->version_tag
+        && _PyType_HasValidVersionTag(type))
+    {
+        descr = cache->descr;
+    }
+    else {
+        PyTypeObject *old_type;
+        PyObject *old_name, *old_descr;
+
+        // _PyType_Lookup() assigns a version tag if possible
+        descr = _PyType_Lookup(type, name);
+        if (!_PyType_HasValidVersionTag(type)) {
+            goto fallback;
+        }
+        old_type = cache->type;
+        old_name = cache->name;
+        old_descr = cache->descr;
+        cache->type = _Py_CAST(PyTypeObject*, Py_NewRef(type));
+        cache->version_tag = type->tp_version_tag;
+        cache->name = Py_NewRef(name);
+        cache->descr = Py_XNewRef(descr);
+        Py_XDECREF(old_type);
+        Py_XDECREF(old_name);
+        Py_XDECREF(old_descr);
+    }
+
+    if (descr != _Py_NULL) {
+        Py_INCREF(descr);
+        get = Py_TYPE(descr)->tp_descr_get;
+        // A data descriptor has the priority over the instance dictionary
+        if (get != _Py_NULL && Py_TYPE(descr)->tp_descr_set != _Py_NULL) {
+            goto call_get;
+        }
+    }
+
+    if (type->tp_dictoffset != 0) {
+        PyObject **dictptr = _PyObject_GetDictPtr(obj);
+        if (dictptr != _Py_NULL && *dictptr != _Py_NULL) {
+            PyObject *dict = Py_NewRef(*dictptr);
+            PyObject *value = PyDict_GetItemWithError(dict, name);
+            if (value != _Py_NULL) {
+                *result = Py_NewRef(value);
+                Py_DECREF(dict);
+                Py_XDECREF(descr);
+                return 1;
+            }
+            Py_DECREF(dict);
+            if (PyErr_Occurred()) {
+                Py_XDECREF(descr);
+                *result = _Py_NULL;
+                return -1;
+            }
+        }
+    }
+
+    if (get != _Py_NULL) {
+        goto call_get;
+    }
+    if (descr != _Py_NULL) {
+        *result = descr;
+        return 1;
+    }
+    *result = _Py_NULL;
+    return 0;
+
+call_get:
+    *result = get(descr, obj, _PyObject_CAST(type));
+    Py_DECREF(descr);
+    if (*result != _Py_NULL) {
+        return 1;
+    }
+    if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        PyErr_Clear();
+        return 0;
+    }
+    return -1;
+
+fallback:
+#else
+    (void)cache;
 #endif
-    if (name_obj == NULL) {
-        *result = NULL;
-        return -1;
-    }
-    rc = PyObject_GetOptionalAttr(obj, name_obj, result);
-    Py_DECREF(name_obj);
-    return rc;
+    return PyObject_GetOptionalAttr(obj, name, result);
 }
-#endif
 
 
 // gh-106307 added PyObject_GetOptionalAttr() and
@@ -952,31 +1924,104 @@ PyThreadState_GetUnchecked(void)
 // gh-110289 added PyUnicode_EqualToUTF8() and PyUnicode_EqualToUTF8AndSize()
 // to Python 3.13.0a1
 #if PY_VERSION_HEX < 0x030D00A1
+#if PY_VERSION_HEX >= 0x030300A1 && !defined(PYPY_VERSION)
+// Compare a non-ASCII string to a UTF-8 encoded string: encode characters on
+// the fly, without allocating memory. Return 0 for surrogate characters which
+// cannot be encoded to UTF-8.
+static inline int
+_PyUnicode_EqualToUTF8Data(PyObject *unicode, const char *str,
+                           Py_ssize_t str_len)
+{
+    const unsigned char *s = _Py_CAST(const unsigned char*, str);
+    int kind = PyUnicode_KIND(unicode);
+    const void *data = PyUnicode_DATA(unicode);
+    Py_ssize_t len = PyUnicode_GET_LENGTH(unicode);
+    Py_ssize_t i, pos = 0;
+
+    // A character is encoded to 1 to 4 bytes
+    if (str_len < len || str_len / 4 > len) {
+        return 0;
+    }
+
+    for (i=0; i < len; i++) {
+        Py_UCS4 ch = PyUnicode_READ(kind, data, i);
+        unsigned char buf[4];
+        Py_ssize_t size;
+
+        if (ch < 0x80) {
+            buf[0] = _Py_CAST(unsigned char, ch);
+            size = 1;
+        }
+        else if (ch < 0x800) {
+            buf[0] = _Py_CAST(unsigned char, 0xc0 | (ch >> 6));
+            buf[1] = _Py_CAST(unsigned char, 0x80 | (ch & 0x3f));
+            size = 2;
+        }
+        else if (ch < 0x10000) {
+            if (0xd800 <= ch && ch <= 0xdfff) {
+                return 0;
+            }
+            buf[0] = _Py_CAST(unsigned char, 0xe0 | (ch >> 12));
+            buf[1] = _Py_CAST(unsigned char, 0x80 | ((ch >> 6) & 0x3f));
+            buf[2] = _Py_CAST(unsigned char, 0x80 | (ch & 0x3f));
+            size = 3;
+        }
+        else {
+            buf[0] = _Py_CAST(unsigned char, 0xf0 | (ch >> 18));
+            buf[1] = _Py_CAST(unsigned char, 0x80 | ((ch >> 12) & 0x3f));
+            buf[2] = _Py_CAST(unsigned char, 0x80 | ((ch >> 6) & 0x3f));
+            buf[3] = _Py_CAST(unsigned char, 0x80 | (ch & 0x3f));
+            size = 4;
+        }
+
+        if (str_len - pos < size
+            || memcmp(s + pos, buf, _Py_CAST(size_t, size)) != 0)
+        {
+            return 0;
+        }
+        pos += size;
+    }
+    return (pos == str_len);
+}
+#endif
+
 static inline int
 PyUnicode_EqualToUTF8AndSize(PyObject *unicode, const char *str, Py_ssize_t str_len)
 {
     Py_ssize_t len;
     const void *utf8;
-    PyObject *exc_type, *exc_value, *exc_tb;
-    int res;
-
-    // API cannot report errors so save/restore the exception
-    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    PyObject *exc_type = NULL, *exc_value = NULL, *exc_tb = NULL;
+    int has_exc, res;
 
     // Python 3.3.0a1 added PyUnicode_AsUTF8AndSize()
 #if PY_VERSION_HEX >= 0x030300A1
-    if (PyUnicode_IS_ASCII(unicode)) {
-        utf8 = PyUnicode_DATA(unicode);
-        len = PyUnicode_GET_LENGTH(unicode);
-    }
-    else {
-        utf8 = PyUnicode_AsUTF8AndSize(unicode, &len);
-        if (utf8 == NULL) {
-            // Memory allocation failure. The API cannot report error,
-            // so ignore the exception and return 0.
-            res = 0;
-            goto done;
+    if (PyUnicode_IS_READY(unicode)) {
+        if (PyUnicode_IS_ASCII(unicode)) {
+            len = PyUnicode_GET_LENGTH(unicode);
+            if (len != str_len) {
+                return 0;
+            }
+            return (memcmp(PyUnicode_DATA(unicode), str, (size_t)len) == 0);
         }
+#ifndef PYPY_VERSION
+        return _PyUnicode_EqualToUTF8Data(unicode, str, str_len);
+#endif
+    }
+#endif
+
+    // API cannot report errors so save/restore the exception
+    has_exc = (PyErr_Occurred() != NULL);
+    if (has_exc) {
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    }
+
+#if PY_VERSION_HEX >= 0x030300A1
+    utf8 = PyUnicode_AsUTF8AndSize(unicode, &len);
+    if (utf8 == NULL) {
+        // Memory allocation failure. The API cannot report error,
+        // so ignore the exception and return 0.
+        res = 0;
+        goto done;
     }
 
     if (len != str_len) {
@@ -1011,7 +2056,12 @@ PyUnicode_EqualToUTF8AndSize(PyObject *unicode, const char *str, Py_ssize_t str_
 #endif
 
 done:
-    PyErr_Restore(exc_type, exc_value, exc_tb);
+    if (has_exc) {
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    }
+    else {
+        PyErr_Clear();
+    }
     return res;
 }
 
@@ -1023,6 +2073,150 @@ PyUnicode_EqualToUTF8(PyObject *unicode, const char *str)
 #endif
 
 
+#if PY_VERSION_HEX >= 0x030300A1
+// Table of keyword parameter names: see _PyKwTable_Match().
+//
+// Only 'names' and 'nnames' must be set, other members must be
+// zero-initialized. Example:
+//
+//     static const char * const names[] = {"key", "default"};
+//     static _PyKwTable kwtable = {names, 2, NULL, NULL, NULL, 0};
+typedef struct {
+    const char * const *names;     // UTF-8 encoded names
+    Py_ssize_t nnames;
+
+    // Private members
+    PyObject *interned;            // tuple of interned names
+    PyObject *kwnames;             // last kwnames tuple
+    Py_ssize_t *indices;           // indices of the last kwnames tuple
+    Py_ssize_t allocated;          // size of the indices array
+} _PyKwTable;
+
+static inline void
+_PyKwTable_Clear(_PyKwTable *table)
+{
+    Py_CLEAR(table->interned);
+    Py_CLEAR(table->kwnames);
+    PyMem_Free(table->indices);
+    table->indices = _Py_NULL;
+    table->allocated = 0;
+}
+
+// Get the index of the parameter 'name', or -1 if there is no such parameter.
+static inline Py_ssize_t
+_PyKwTable_Find(_PyKwTable *table, PyObject *name)
+{
+    Py_ssize_t i;
+
+    // Keyword names are usually interned: first compare pointers
+    if (table->interned != _Py_NULL) {
+        for (i=0; i < table->nnames; i++) {
+            if (PyTuple_GET_ITEM(table->interned, i) == name) {
+                return i;
+            }
+        }
+    }
+
+    if (!PyUnicode_Check(name)) {
+        return -1;
+    }
+    if (PyUnicode_IS_ASCII(name)) {
+        // Compare the first byte, the length, and then the bytes.
+        // Strings are NUL terminated.
+        const char *data = _Py_CAST(const char*, PyUnicode_DATA(name));
+        size_t len = _Py_CAST(size_t, PyUnicode_GET_LENGTH(name));
+        for (i=0; i < table->nnames; i++) {
+            const char *cname = table->names[i];
+            if (cname[0] == data[0]
+                && strlen(cname) == len
+                && memcmp(cname, data, len) == 0)
+            {
+                return i;
+            }
+        }
+    }
+    else {
+        for (i=0; i < table->nnames; i++) {
+            if (PyUnicode_EqualToUTF8(name, table->names[i])) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// Map the vectorcall keyword names 'kwnames' to parameter indices in a single
+// pass: set indices[i] to the index in table->names of kwnames[i], or to -1 if
+// the keyword is unknown. 'indices' must have PyTuple_GET_SIZE(kwnames)
+// items. 'kwnames' can be NULL.
+//
+// The result is cached per kwnames tuple: the keyword names of a call site are
+// usually a constant tuple. Release the cache with _PyKwTable_Clear().
+//
+// Return 0 on success. Set an exception and return -1 on error.
+static inline int
+_PyKwTable_Match(_PyKwTable *table, PyObject *kwnames, Py_ssize_t *indices)
+{
+    Py_ssize_t i, nkw;
+
+    if (kwnames == _Py_NULL) {
+        return 0;
+    }
+    nkw = PyTuple_GET_SIZE(kwnames);
+
+    // The cache is not thread-safe on the free-threaded build
+#ifndef Py_GIL_DISABLED
+    if (kwnames == table->kwnames) {
+        if (nkw != 0) {
+            memcpy(indices, table->indices, (size_t)nkw * sizeof(indices[0]));
+        }
+        return 0;
+    }
+
+    if (table->interned == _Py_NULL) {
+        PyObject *interned = PyTuple_New(table->nnames);
+        if (interned == _Py_NULL) {
+            return -1;
+        }
+        for (i=0; i < table->nnames; i++) {
+            PyObject *name = PyUnicode_InternFromString(table->names[i]);
+            if (name == _Py_NULL) {
+                Py_DECREF(interned);
+                return -1;
+            }
+            PyTuple_SET_ITEM(interned, i, name);
+        }
+        table->interned = interned;
+    }
+#endif
+
+    for (i=0; i < nkw; i++) {
+        indices[i] = _PyKwTable_Find(table, PyTuple_GET_ITEM(kwnames, i));
+    }
+
+#ifndef Py_GIL_DISABLED
+    Py_CLEAR(table->kwnames);
+    if (nkw > table->allocated) {
+        size_t size = (size_t)nkw * sizeof(indices[0]);
+        Py_ssize_t *cache = _Py_CAST(Py_ssize_t*,
+                                     PyMem_Realloc(table->indices, size));
+        if (cache == _Py_NULL) {
+            // Don't cache the result
+            return 0;
+        }
+        table->indices = cache;
+        table->allocated = nkw;
+    }
+    if (nkw != 0) {
+        memcpy(table->indices, indices, (size_t)nkw * sizeof(indices[0]));
+    }
+    table->kwnames = Py_NewRef(kwnames);
+#endif
+    return 0;
+}
+#endif
+
+
 // gh-111138 added PyList_Extend() and PyList_Clear() to Python 3.13.0a2
 #if PY_VERSION_HEX < 0x030D00A2
 static inline int
@@ -1106,6 +2300,85 @@ typedef Py_ssize_t Py_hash_t;
 #endif
 
 
+// Dictionary functions taking a precomputed hash of the key, so the key can
+// be hashed once and the hash reused across several operations. The hash
+// must be the hash of the key: PyObject_Hash(key).
+//
+// Use _PyDict_GetItem_KnownHash(), _PyDict_SetItem_KnownHash() and
+// _PyDict_DelItem_KnownHash() of Python 3.6-3.12. Python 3.13 moved
+// _PyDict_SetItem_KnownHash() and _PyDict_DelItem_KnownHash() to the internal
+// C API.
+#if 0x03060000 <= PY_VERSION_HEX && PY_VERSION_HEX < 0x030D0000 && !defined(PYPY_VERSION) && !defined(Py_GIL_DISABLED)
+#  define _PYTHONCAPI_COMPAT_DICT_KNOWN_HASH
+#endif
+
+static inline int
+_PyDict_KnownHash_GetItemRef(PyObject *mp, PyObject *key, Py_hash_t hash,
+                             PyObject **result)
+{
+#ifdef _PYTHONCAPI_COMPAT_DICT_KNOWN_HASH
+    PyObject *item;
+    if (!PyDict_Check(mp)) {
+        PyErr_BadInternalCall();
+        *result = _Py_NULL;
+        return -1;
+    }
+    item = _PyDict_GetItem_KnownHash(mp, key, hash);
+    if (item != _Py_NULL) {
+        *result = Py_NewRef(item);
+        return 1;
+    }
+    *result = _Py_NULL;
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+    return 0;
+#else
+    (void)hash;
+    return PyDict_GetItemRef(mp, key, result);
+#endif
+}
+
+static inline int
+_PyDict_KnownHash_SetItem(PyObject *mp, PyObject *key, Py_hash_t hash,
+                          PyObject *value)
+{
+#ifdef _PYTHONCAPI_COMPAT_DICT_KNOWN_HASH
+    return _PyDict_SetItem_KnownHash(mp, key, value, hash);
+#else
+    (void)hash;
+    return PyDict_SetItem(mp, key, value);
+#endif
+}
+
+static inline int
+_PyDict_KnownHash_Pop(PyObject *mp, PyObject *key, Py_hash_t hash,
+                      PyObject **result)
+{
+#ifdef _PYTHONCAPI_COMPAT_DICT_KNOWN_HASH
+    PyObject *value;
+    int res = _PyDict_KnownHash_GetItemRef(mp, key, hash, &value);
+    if (res == 1) {
+        if (_PyDict_DelItem_KnownHash(mp, key, hash) < 0) {
+            Py_DECREF(value);
+            value = _Py_NULL;
+            res = -1;
+        }
+    }
+    if (result) {
+        *result = value;
+    }
+    else {
+        Py_XDECREF(value);
+    }
+    return res;
+#else
+    (void)hash;
+    return PyDict_Pop(mp, key, result);
+#endif
+}
+
+
 // gh-111545 added Py_HashPointer() to Python 3.13.0a3
 #if PY_VERSION_HEX < 0x030D00A3
 static inline Py_hash_t Py_HashPointer(const void *ptr)
@@ -1315,6 +2588,33 @@ PyDict_SetDefaultRef(PyObject *d, PyObject *key, PyObject *default_value,
                      PyObject **result)
 {
     PyObject *value;
+#if PY_VERSION_HEX >= 0x03040000 && !defined(PYPY_VERSION)
+    // Python 3.4 added PyDict_SetDefault(): hash the key and probe the
+    // dictionary only once. The item was inserted if the dictionary grew.
+    Py_ssize_t size;
+    if (!PyDict_Check(d)) {
+        PyErr_BadInternalCall();
+        if (result) {
+            *result = NULL;
+        }
+        return -1;
+    }
+    size = PyDict_Size(d);
+    value = PyDict_SetDefault(d, key, default_value);
+    if (value == NULL) {
+        if (result) {
+            *result = NULL;
+        }
+        return -1;
+    }
+    if (result) {
+        *result = Py_NewRef(value);
+    }
+    if (value == default_value && PyDict_Size(d) > size) {
+        return 0;
+    }
+    return 1;
+#else
     if (PyDict_GetItemRef(d, key, &value) < 0) {
         // get error
         if (result) {
@@ -1345,6 +2645,7 @@ PyDict_SetDefaultRef(PyObject *d, PyObject *key, PyObject *default_value,
         *result = Py_NewRef(default_value);
     }
     return 0;
+#endif
 }
 #endif
 
@@ -2312,6 +3613,42 @@ static inline void PyUnstable_EnableTryIncRef(PyObject *op)
 }
 #endif
 
+// gh-123619 added PyUnstable_Object_EnableDeferredRefcount() to Python
+// 3.14.0a2. On the Python 3.13 free-threaded build, adapted from
+// _PyObject_SetDeferredRefcount().
+#if PY_VERSION_HEX < 0x030E00A2
+static inline int PyUnstable_Object_EnableDeferredRefcount(PyObject *op)
+{
+#if defined(Py_GIL_DISABLED) && PY_VERSION_HEX >= 0x030D0000
+    // _PyGC_BITS_DEFERRED of the internal C API
+    const uint8_t deferred = 64;
+
+    if (!PyType_IS_GC(Py_TYPE(op))) {
+        // Deferred reference counting doesn't work on untracked types
+        return 0;
+    }
+    if ((op->ob_gc_bits & deferred) != 0) {
+        // Nothing to do
+        return 0;
+    }
+    // Python 3.13 can only enable deferred reference counting before the
+    // object is shared with other threads
+    if (!_Py_IsOwnedByCurrentThread(op)
+        || _Py_atomic_load_ssize_relaxed(&op->ob_ref_shared) != 0)
+    {
+        return 0;
+    }
+    op->ob_gc_bits |= deferred;
+    op->ob_ref_local += 1;
+    op->ob_ref_shared = _Py_REF_QUEUED;
+    return 1;
+#else
+    (void)op;  // unused argument
+    return 0;
+#endif
+}
+#endif
+
 
 #if PY_VERSION_HEX < 0x030F0000
 static inline PyObject*
@@ -2652,6 +3989,24 @@ PyTuple_FromArray(PyObject *const *array, Py_ssize_t size)
 }
 #endif
 
+// Similar to PyTuple_FromArray(), but steal references to items, even on
+// error.
+static inline PyObject*
+_PyTuple_FromArrayStealRef(PyObject *const *array, Py_ssize_t size)
+{
+    PyObject *tuple = PyTuple_New(size);
+    if (tuple == NULL) {
+        for (Py_ssize_t i=0; i < size; i++) {
+            Py_DECREF(array[i]);
+        }
+        return NULL;
+    }
+    for (Py_ssize_t i=0; i < size; i++) {
+        PyTuple_SET_ITEM(tuple, i, array[i]);
+    }
+    return tuple;
+}
+
 
 #if PY_VERSION_HEX < 0x030F00A1
 static inline Py_hash_t
@@ -2703,6 +4058,140 @@ PyUnstable_SetImmortal(PyObject *op)
 }
 #endif
 
+#if 0x030D0000 <= PY_VERSION_HEX && !defined(PYPY_VERSION)
+static inline int _PyObject_CheckImmortalTree(PyObject *obj)
+{
+    int res = 0;
+
+    if (PyTuple_CheckExact(obj)) {
+        Py_ssize_t i;
+        if (Py_EnterRecursiveCall(" while checking an immortal tree")) {
+            return -1;
+        }
+        for (i = 0; i < PyTuple_GET_SIZE(obj); i++) {
+            if (_PyObject_CheckImmortalTree(PyTuple_GET_ITEM(obj, i)) < 0) {
+                res = -1;
+                break;
+            }
+        }
+        Py_LeaveRecursiveCall();
+        return res;
+    }
+    if (PyFrozenSet_CheckExact(obj)) {
+        // Frozenset items can only be hashable immutable objects, but they
+        // are checked anyway to reject instances of user classes.
+        PyObject *iter, *item;
+        if (Py_EnterRecursiveCall(" while checking an immortal tree")) {
+            return -1;
+        }
+        iter = PyObject_GetIter(obj);
+        if (iter == _Py_NULL) {
+            Py_LeaveRecursiveCall();
+            return -1;
+        }
+        while ((item = PyIter_Next(iter)) != _Py_NULL) {
+            res = _PyObject_CheckImmortalTree(item);
+            Py_DECREF(item);
+            if (res < 0) {
+                break;
+            }
+        }
+        Py_DECREF(iter);
+        Py_LeaveRecursiveCall();
+        if (res == 0 && PyErr_Occurred()) {
+            res = -1;
+        }
+        return res;
+    }
+
+    if (obj == Py_None || obj == Py_Ellipsis || PyBool_Check(obj)
+        || PyLong_CheckExact(obj) || PyFloat_CheckExact(obj)
+        || PyComplex_CheckExact(obj) || PyBytes_CheckExact(obj)
+        || PyUnicode_CheckExact(obj))
+    {
+        return 0;
+    }
+    PyErr_Format(PyExc_TypeError,
+                 "cannot make %s object immortal: "
+                 "only tuple, frozenset, None, Ellipsis, bool, int, float, "
+                 "complex, bytes and str objects are supported",
+                 Py_TYPE(obj)->tp_name);
+    return -1;
+}
+
+// Only borrowed references are used to walk the tree: new references would
+// prevent PyUnstable_SetImmortal() from making the items immortal.
+static inline Py_ssize_t
+_PyObject_SetImmortalTreeImpl(PyObject *obj, PyObject *skipped)
+{
+    Py_ssize_t count = 0;
+
+    if (_Py_IsImmortal(obj)) {
+        return 0;
+    }
+
+    if (PyTuple_CheckExact(obj)) {
+        Py_ssize_t i;
+        for (i = 0; i < PyTuple_GET_SIZE(obj); i++) {
+            Py_ssize_t res;
+            res = _PyObject_SetImmortalTreeImpl(PyTuple_GET_ITEM(obj, i),
+                                                skipped);
+            if (res < 0) {
+                return -1;
+            }
+            count += res;
+        }
+    }
+    else if (PyFrozenSet_CheckExact(obj)) {
+        PyObject *iter, *item;
+        iter = PyObject_GetIter(obj);
+        if (iter == _Py_NULL) {
+            return -1;
+        }
+        while ((item = PyIter_Next(iter)) != _Py_NULL) {
+            Py_ssize_t res;
+            // The frozenset keeps the item alive
+            Py_DECREF(item);
+            res = _PyObject_SetImmortalTreeImpl(item, skipped);
+            if (res < 0) {
+                Py_DECREF(iter);
+                return -1;
+            }
+            count += res;
+        }
+        // The iterator holds a reference to the frozenset: destroy it
+        // before making the frozenset immortal.
+        Py_DECREF(iter);
+        if (PyErr_Occurred()) {
+            return -1;
+        }
+    }
+
+    if (PyUnstable_SetImmortal(obj)) {
+        count++;
+    }
+    else if (skipped != _Py_NULL) {
+        if (PyList_Append(skipped, obj) < 0) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+static inline Py_ssize_t
+_PyObject_SetImmortalTree(PyObject *obj, PyObject *skipped)
+{
+    if (skipped != _Py_NULL && !PyList_Check(skipped)) {
+        PyErr_SetString(PyExc_TypeError, "skipped must be a list");
+        return -1;
+    }
+    if (_PyObject_CheckImmortalTree(obj) < 0) {
+        return -1;
+    }
+    return _PyObject_SetImmortalTreeImpl(obj, skipped);
+}
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,168 @@
+#!/usr/bin/python3
+"""
+Microbenchmark of the reference counting functions of pythoncapi_compat.h
+under contention: run them from 1 to N threads on owned, shared and immortal
+objects, and display ops/sec and the scaling relative to a single thread.
+
+Usage::
+
+    python3 bench_refcount.py
+    python3 bench_refcount.py --threads 16 --loops 5000000
+    python3 bench_refcount.py --op tryincref --object shared
+
+The scaling is only meaningful on a free-threaded build (ex: python3.13t):
+on the default build, threads are serialized by the GIL.
+"""
+import argparse
+import os.path
+import sys
+import threading
+import time
+
+import test_pythoncapi_compat
+
+
+OPERATIONS = (
+    "tryincref",
+    "enable_tryincref",
+    "is_uniquely_referenced",
+    "set_immortal",
+)
+OBJECTS = ("owned", "shared", "immortal")
+
+# bench_refcount_cext extension module, imported by main()
+mod = None
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="Reference counting microbenchmark")
+    parser.add_argument(
+        '-t', '--threads', type=int, default=min(os.cpu_count() or 1, 8),
+        help="Maximum number of threads (default: number of CPUs, up to 8)")
+    parser.add_argument(
+        '-n', '--loops', type=int, default=10 ** 6,
+        help="Number of operations per thread (default: %(default)s)")
+    parser.add_argument(
+        '-r', '--repeat', type=int, default=3,
+        help="Number of runs, keep the fastest (default: %(default)s)")
+    parser.add_argument(
+        '--op', action='append', choices=OPERATIONS,
+        help="Only benchmark this operation (can be used multiple times)")
+    parser.add_argument(
+        '--object', action='append', choices=OBJECTS,
+        help="Only benchmark this kind of object (can be used multiple times)")
+    parser.add_argument(
+        '--no-build', action='store_true',
+        help="Don't rebuild the extension if it was already built")
+    args = parser.parse_args()
+    if args.threads < 1:
+        parser.error("--threads must be >= 1")
+    return args
+
+
+def thread_counts(max_threads):
+    counts = []
+    nthread = 1
+    while nthread < max_threads:
+        counts.append(nthread)
+        nthread *= 2
+    counts.append(max_threads)
+    return counts
+
+
+def create_object(kind, shared_obj):
+    if kind == "owned":
+        # Created by the thread which runs the benchmark
+        return []
+    if kind == "shared":
+        return shared_obj
+    # Immortal since Python 3.12
+    return None
+
+
+def run_threads(func, kind, nthread, loops):
+    shared_obj = []
+    # Allow other threads to use PyUnstable_TryIncRef() on the object
+    mod.enable_tryincref(shared_obj, 1)
+
+    barrier = threading.Barrier(nthread)
+    timings = []
+
+    def worker():
+        obj = create_object(kind, shared_obj)
+        barrier.wait()
+        t0 = time.perf_counter()
+        func(obj, loops)
+        t1 = time.perf_counter()
+        timings.append((t0, t1))
+
+    threads = [threading.Thread(target=worker) for _ in range(nthread)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    start = min(t0 for t0, t1 in timings)
+    end = max(t1 for t0, t1 in timings)
+    return end - start
+
+
+def bench(func, kind, nthread, args):
+    dt = min(run_threads(func, kind, nthread, args.loops)
+             for _ in range(args.repeat))
+    return (nthread * args.loops) / dt
+
+
+def format_rate(rate):
+    if rate >= 1e9:
+        return "%.2f G" % (rate / 1e9)
+    if rate >= 1e6:
+        return "%.2f M" % (rate / 1e6)
+    if rate >= 1e3:
+        return "%.2f k" % (rate / 1e3)
+    return "%.2f" % rate
+
+
+def main():
+    global mod
+
+    args = parse_args()
+
+    src_dir = os.path.dirname(__file__)
+    if src_dir:
+        os.chdir(src_dir)
+    if not (args.no_build and os.path.exists("build")):
+        test_pythoncapi_compat.build_ext()
+    mod = test_pythoncapi_compat.import_tests("bench_refcount_cext")
+
+    print(test_pythoncapi_compat.python_version())
+    if not mod.FREE_THREADING:
+        print("WARNING: threads are serialized by the GIL")
+    print()
+
+    operations = args.op or OPERATIONS
+    kinds = args.object or OBJECTS
+    counts = thread_counts(args.threads)
+
+    print("%-24s %-9s %7s %12s %8s"
+          % ("operation", "object", "threads", "ops/sec", "scaling"))
+    for name in operations:
+        func = getattr(mod, name, None)
+        if func is None:
+            print("%-24s (not available)" % name)
+            continue
+
+        for kind in kinds:
+            base = None
+            for nthread in counts:
+                rate = bench(func, kind, nthread, args)
+                if base is None:
+                    base = rate
+                print("%-24s %-9s %7s %12s %7.2fx"
+                      % (name, kind, nthread, format_rate(rate), rate / base))
+                sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,162 @@
+// Microbenchmark of the reference counting functions of pythoncapi_compat.h.
+//
+// Each function runs an operation "loops" times on the same object and
+// returns the number of iterations where the operation succeeded. The driver
+// script bench_refcount.py calls these functions from multiple threads.
+//
+// The GIL is never released: on the free-threaded build, threads run in
+// parallel anyway, and on the default build, refcount operations must not
+// run without holding the GIL.
+//
+// The object is read from a volatile variable at each iteration to prevent
+// the compiler from moving the operation out of the loop.
+
+#include "pythoncapi_compat.h"
+
+#if 0x030D0000 <= PY_VERSION_HEX && PY_VERSION_HEX < 0x030F00A7 && !defined(PYPY_VERSION)
+#  define HAVE_SET_IMMORTAL
+#endif
+
+
+static int
+parse_args(PyObject *args, PyObject *volatile *obj, Py_ssize_t *loops)
+{
+    PyObject *arg;
+    if (!PyArg_ParseTuple(args, "On", &arg, loops)) {
+        return -1;
+    }
+    *obj = arg;
+    if (*loops < 0) {
+        PyErr_SetString(PyExc_ValueError, "loops must be >= 0");
+        return -1;
+    }
+    return 0;
+}
+
+
+static PyObject *
+bench_tryincref(PyObject *Py_UNUSED(module), PyObject *args)
+{
+    PyObject *volatile obj;
+    Py_ssize_t loops, i, ok = 0;
+    if (parse_args(args, &obj, &loops) < 0) {
+        return _Py_NULL;
+    }
+
+    for (i = 0; i < loops; i++) {
+        PyObject *op = obj;
+        if (PyUnstable_TryIncRef(op)) {
+            Py_DECREF(op);
+            ok++;
+        }
+    }
+    return PyLong_FromSsize_t(ok);
+}
+
+
+static PyObject *
+bench_enable_tryincref(PyObject *Py_UNUSED(module), PyObject *args)
+{
+    PyObject *volatile obj;
+    Py_ssize_t loops, i;
+    if (parse_args(args, &obj, &loops) < 0) {
+        return _Py_NULL;
+    }
+
+    for (i = 0; i < loops; i++) {
+        PyUnstable_EnableTryIncRef(obj);
+    }
+    return PyLong_FromSsize_t(loops);
+}
+
+
+static PyObject *
+bench_is_uniquely_referenced(PyObject *Py_UNUSED(module), PyObject *args)
+{
+    PyObject *volatile obj;
+    Py_ssize_t loops, i, ok = 0;
+    if (parse_args(args, &obj, &loops) < 0) {
+        return _Py_NULL;
+    }
+
+    for (i = 0; i < loops; i++) {
+        ok += PyUnstable_Object_IsUniquelyReferenced(obj);
+    }
+    return PyLong_FromSsize_t(ok);
+}
+
+
+#ifdef HAVE_SET_IMMORTAL
+// Measure the check path of PyUnstable_SetImmortal(): the object is not
+// uniquely referenced, so it is never made immortal. Making an object
+// immortal can only succeed once per object.
+static PyObject *
+bench_set_immortal(PyObject *Py_UNUSED(module), PyObject *args)
+{
+    PyObject *volatile obj;
+    Py_ssize_t loops, i, ok = 0;
+    if (parse_args(args, &obj, &loops) < 0) {
+        return _Py_NULL;
+    }
+
+    Py_INCREF(obj);
+    for (i = 0; i < loops; i++) {
+        ok += PyUnstable_SetImmortal(obj);
+    }
+    Py_DECREF(obj);
+    return PyLong_FromSsize_t(ok);
+}
+#endif
+
+
+static struct PyMethodDef methods[] = {
+    {"tryincref", bench_tryincref, METH_VARARGS, _Py_NULL},
+    {"enable_tryincref", bench_enable_tryincref, METH_VARARGS, _Py_NULL},
+    {"is_uniquely_referenced", bench_is_uniquely_referenced, METH_VARARGS, _Py_NULL},
+#ifdef HAVE_SET_IMMORTAL
+    {"set_immortal", bench_set_immortal, METH_VARARGS, _Py_NULL},
+#endif
+    {_Py_NULL, _Py_NULL, 0, _Py_NULL}
+};
+
+
+static int
+module_exec(PyObject *module)
+{
+#ifdef Py_GIL_DISABLED
+    int free_threading = 1;
+#else
+    int free_threading = 0;
+#endif
+    return PyModule_Add(module, "FREE_THREADING",
+                        PyBool_FromLong(free_threading));
+}
+
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, _Py_CAST(void*, module_exec)},
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, _Py_NULL}
+};
+
+
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    "bench_refcount_cext",  // m_name
+    _Py_NULL,               // m_doc
+    0,                      // m_size
+    methods,                // m_methods
+    module_slots,           // m_slots
+    _Py_NULL,               // m_traverse
+    _Py_NULL,               // m_clear
+    _Py_NULL,               // m_free
+};
+
+
+PyMODINIT_FUNC
+PyInit_bench_refcount_cext(void)
+{
+    return PyModuleDef_Init(&module_def);
+}
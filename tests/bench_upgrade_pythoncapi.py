@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+"""
+Benchmark upgrade_pythoncapi.py operations on a synthetic C corpus, or on
+existing C files, and display files/sec and MB/sec per operation.
+
+Usage::
+
+    python3 bench_upgrade_pythoncapi.py
+    python3 bench_upgrade_pythoncapi.py --files 500 --repeat 5
+    python3 bench_upgrade_pythoncapi.py --corpus /path/to/project
+    python3 bench_upgrade_pythoncapi.py -o Py_NewRef -o Py_SETREF
+"""
+import argparse
+import os
+import sys
+import time
+
+# Get upgrade_pythoncapi.py of the parent directory
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+import upgrade_pythoncapi   # noqa
+
+
+# Code patched by each operation
+SNIPPETS = {
+    "Py_TYPE": """
+    PyTypeObject *type = obj->ob_type;
+""",
+    "Py_SIZE": """
+    Py_ssize_t size = var->ob_size;
+""",
+    "Py_REFCNT": """
+    Py_ssize_t refcnt = obj->ob_refcnt;
+""",
+    "Py_SET_TYPE": """
+    Py_TYPE(obj) = type;
+    obj->ob_type = &PyList_Type;
+""",
+    "Py_SET_SIZE": """
+    Py_SIZE(var) = size;
+    var->ob_size = 0;
+""",
+    "Py_SET_REFCNT": """
+    Py_REFCNT(obj) = 1;
+    obj->ob_refcnt = refcnt;
+""",
+    "Py_Is": """
+    if (value == Py_None || flag != Py_True || other == Py_False) {
+        return NULL;
+    }
+""",
+    "PyObject_NEW": """
+    obj = PyObject_NEW(PyObject, &PyBaseObject_Type);
+    var = PyObject_NEW_VAR(PyVarObject, &PyTuple_Type, 3);
+""",
+    "PyMem_MALLOC": """
+    ptr = PyMem_MALLOC(size);
+    ptr = PyMem_REALLOC(ptr, size * 2);
+    PyMem_FREE(ptr);
+""",
+    "PyObject_MALLOC": """
+    ptr = PyObject_MALLOC(size);
+    ptr = PyObject_REALLOC(ptr, size * 2);
+    PyObject_FREE(ptr);
+""",
+    "PyFrame_GetBack": """
+    PyFrameObject *back = frame->f_back;
+""",
+    "PyFrame_GetCode": """
+    PyCodeObject *code = frame->f_code;
+""",
+    "PyThreadState_GetInterpreter": """
+    PyInterpreterState *interp = tstate->interp;
+""",
+    "PyThreadState_GetFrame": """
+    frame = tstate->frame;
+""",
+    "Py_NewRef": """
+    Py_INCREF(value);
+    self->value = value;
+    PyObject *copy = (PyObject *)value;
+    Py_XINCREF(copy);
+    Py_INCREF(result);
+    return result;
+""",
+    "Py_CLEAR": """
+    Py_XDECREF(self->cache);
+    self->cache = NULL;
+""",
+    "Py_SETREF": """
+    Py_DECREF(self->name);
+    self->name = name;
+    Py_XINCREF(attr);
+    Py_CLEAR(self->attr);
+    self->attr = attr;
+""",
+}
+
+# Code which is not patched
+FILLER = """
+static int
+compute_{index}(int a, int b, const char *msg)
+{{
+    /* Comment mentioning nothing interesting: {index} */
+    int result = a * {index} + b;
+    if (result < 0 && msg != NULL) {{
+        fprintf(stderr, "negative result: %s (%d)\\n", msg, result);
+        return -1;
+    }}
+    return result;
+}}
+"""
+
+# Long line, like generated code (ex: Cython)
+LONG_LINE = ("    static const char *table_{index}[] = {{"
+             + ", ".join(f'"item{i}"' for i in range(200))
+             + "}};\n")
+
+
+def generate_file(index):
+    parts = ['#include "Python.h"\n']
+    for name, code in SNIPPETS.items():
+        parts.append(FILLER.format(index=f"{index}_{len(parts)}"))
+        func = name.lower()
+        parts.append(f"\nstatic PyObject *\ntest_{func}_{index}(PyObject *obj)\n"
+                     "{")
+        parts.append(code)
+        parts.append(LONG_LINE.format(index=len(parts)))
+        parts.append("    return NULL;\n}\n")
+    return ''.join(parts)
+
+
+def generate_corpus(nfile):
+    return [generate_file(index) for index in range(nfile)]
+
+
+def load_corpus(paths):
+    patcher = upgrade_pythoncapi.Patcher(['-o', 'all', *paths])
+    corpus = []
+    for filename in patcher.walk(paths):
+        with open(filename, encoding="utf-8", errors="surrogateescape",
+                  newline="") as fp:
+            corpus.append(fp.read())
+    return corpus
+
+
+def bench_operation(operations, corpus, repeat):
+    patcher = upgrade_pythoncapi.Patcher(['-C', '-o', operations, 'bench.c'])
+    best = None
+    for _ in range(repeat):
+        t0 = time.perf_counter()
+        for content in corpus:
+            patcher.patch(content)
+        dt = time.perf_counter() - t0
+        if best is None or dt < best:
+            best = dt
+    return best
+
+
+def check_snippets():
+    # Check that each snippet is patched by its operation
+    names = set(operation.NAME for operation in upgrade_pythoncapi.OPERATIONS)
+    missing = names - set(SNIPPETS)
+    if missing:
+        raise Exception(f"missing snippets: {', '.join(sorted(missing))}")
+    for name, code in SNIPPETS.items():
+        patcher = upgrade_pythoncapi.Patcher(['-C', '-o', name, 'bench.c'])
+        if patcher.patch(code) == code:
+            raise Exception(f"{name} snippet is not patched")
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="Benchmark upgrade_pythoncapi.py operations")
+    parser.add_argument(
+        '-n', '--files', type=int, default=200,
+        help="Number of files of the synthetic corpus "
+             "(default: %(default)s)")
+    parser.add_argument(
+        '--corpus', metavar='PATH', action='append',
+        help="Use C files of PATH (file or directory) "
+             "instead of a synthetic corpus")
+    parser.add_argument(
+        '-r', '--repeat', type=int, default=3,
+        help="Number of runs, keep the fastest (default: %(default)s)")
+    parser.add_argument(
+        '-o', '--operation', action='append',
+        help="Only benchmark this operation (can be used multiple times)")
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    check_snippets()
+
+    if args.corpus:
+        corpus = load_corpus(args.corpus)
+    else:
+        corpus = generate_corpus(args.files)
+    if not corpus:
+        print("empty corpus")
+        sys.exit(1)
+    size = sum(len(content.encode("utf-8", "surrogateescape"))
+               for content in corpus)
+    print(f"Corpus: {len(corpus)} files, {size / 1e6:.1f} MB")
+    print()
+
+    if args.operation:
+        names = args.operation
+    else:
+        names = [operation.NAME for operation in upgrade_pythoncapi.OPERATIONS]
+        names.append("all")
+    print("%-30s %10s %10s %10s" % ("operation", "time", "files/sec", "MB/sec"))
+    for name in names:
+        dt = bench_operation(name, corpus, args.repeat)
+        print("%-30s %9.3fs %10.1f %10.2f"
+              % (name, dt, len(corpus) / dt, size / 1e6 / dt))
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -122,6 +122,14 @@ def main():
                 language='c++')
             extensions.append(cpp_ext)
 
+    if sys.version_info >= (3, 5):
+        # Reference counting microbenchmark, see bench_refcount.py
+        bench_ext = Extension(
+            'bench_refcount_cext',
+            sources=['bench_refcount_cext.c'],
+            extra_compile_args=CFLAGS)
+        extensions.append(bench_ext)
+
     setup(name="test_pythoncapi_compat",
           ext_modules=extensions)
 
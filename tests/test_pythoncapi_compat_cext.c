@@ -214,6 +214,46 @@ test_frame_getvar(PyFrameObject *frame)
     assert(name4 == _Py_NULL);
     assert(PyErr_ExceptionMatches(PyExc_NameError));
     PyErr_Clear();
+
+    // test PyFrame_GetVar() and _PyFrame_GetVarCached(): compare with
+    // PyFrame_GetLocals()
+    _PyFrame_VarCache cache = {_Py_NULL, _Py_NULL, 0};
+    PyObject *locals = PyFrame_GetLocals(frame);
+    assert(locals != _Py_NULL);
+    PyObject *keys = PyMapping_Keys(locals);
+    assert(keys != _Py_NULL);
+    assert(PyList_GET_SIZE(keys) >= 1);
+    for (Py_ssize_t i=0; i < PyList_GET_SIZE(keys); i++) {
+        PyObject *key = PyList_GET_ITEM(keys, i);
+        PyObject *expected = PyObject_GetItem(locals, key);
+        assert(expected != _Py_NULL);
+
+        PyObject *value = PyFrame_GetVar(frame, key);
+        assert(value == expected);
+        Py_DECREF(value);
+
+        for (int j=0; j < 2; j++) {
+            value = _PyFrame_GetVarCached(&cache, frame, key);
+            assert(value == expected);
+            Py_DECREF(value);
+        }
+        Py_DECREF(expected);
+    }
+    Py_DECREF(keys);
+    Py_DECREF(locals);
+
+    // test _PyFrame_GetVarCached() NameError
+    PyObject *attr5 = PyUnicode_FromString("dontexist");
+    assert(attr5 != _Py_NULL);
+    PyObject *name5 = _PyFrame_GetVarCached(&cache, frame, attr5);
+    Py_DECREF(attr5);
+    assert(name5 == _Py_NULL);
+    assert(PyErr_ExceptionMatches(PyExc_NameError));
+    PyErr_Clear();
+
+    _PyFrame_VarCache_Clear(&cache);
+    assert(cache.code == _Py_NULL);
+    assert(cache.name == _Py_NULL);
 }
 
 
@@ -299,6 +339,22 @@ test_frame(PyObject *Py_UNUSED(module), PyObject* Py_UNUSED(ignored))
     // test PyFrame_GetVar() and PyFrame_GetVarString()
     test_frame_getvar(frame);
 
+    // test _PyThreadState_GetStackSamples()
+    _PyFrameSample samples[64];
+    Py_ssize_t nsample = _PyThreadState_GetStackSamples(tstate, samples, 64);
+    Py_ssize_t depth = 0;
+    for (PyFrameObject *f = frame; f != _Py_NULL; f = _PyFrame_GetBackBorrow(f)) {
+        if (depth < 64) {
+            assert(samples[depth].code == _PyFrame_GetCodeBorrow(f));
+            assert(samples[depth].lasti == PyFrame_GetLasti(f));
+        }
+        depth++;
+    }
+    assert(nsample == (depth < 64 ? depth : 64));
+    assert(nsample >= 1);
+    assert(_PyThreadState_GetStackSamples(tstate, samples, 1) == 1);
+    assert(_PyThreadState_GetStackSamples(tstate, samples, 0) == 0);
+
     // done
     Py_DECREF(frame);
     Py_RETURN_NONE;
@@ -666,6 +722,85 @@ test_code(PyObject *Py_UNUSED(module), PyObject* Py_UNUSED(ignored))
         Py_DECREF(co_freevars);
     }
 
+    // _PyCode_GetCodeBorrow(), _PyCode_GetVarnamesBorrow(),
+    // _PyCode_GetCellvarsBorrow() and _PyCode_GetFreevarsBorrow()
+    {
+        PyObject *co_code = PyCode_GetCode(code);
+        PyObject *co_code2 = _PyCode_GetCodeBorrow(code);
+        assert(co_code2 != _Py_NULL);
+        assert(PyObject_RichCompareBool(co_code2, co_code, Py_EQ) == 1);
+        assert(_PyCode_GetCodeBorrow(code) == co_code2);
+        Py_DECREF(co_code);
+
+        PyObject *co_varnames = PyCode_GetVarnames(code);
+        PyObject *co_varnames2 = _PyCode_GetVarnamesBorrow(code);
+        assert(co_varnames2 != _Py_NULL);
+        assert(PyObject_RichCompareBool(co_varnames2, co_varnames, Py_EQ) == 1);
+        assert(_PyCode_GetVarnamesBorrow(code) == co_varnames2);
+        Py_DECREF(co_varnames);
+
+        PyObject *co_cellvars = _PyCode_GetCellvarsBorrow(code);
+        assert(co_cellvars != _Py_NULL);
+        assert(PyTuple_CheckExact(co_cellvars));
+        assert(PyTuple_GET_SIZE(co_cellvars) == 0);
+        assert(_PyCode_GetCellvarsBorrow(code) == co_cellvars);
+
+        PyObject *co_freevars = _PyCode_GetFreevarsBorrow(code);
+        assert(co_freevars != _Py_NULL);
+        assert(PyTuple_CheckExact(co_freevars));
+        assert(PyTuple_GET_SIZE(co_freevars) == 0);
+        assert(_PyCode_GetFreevarsBorrow(code) == co_freevars);
+    }
+
+    // _PyCode_Addr2LineCached()
+    {
+        PyObject *compiled = Py_CompileString("x = 1\n"
+                                              "\n"
+                                              "y = 2\n"
+                                              "if x:\n"
+                                              "    z = 3\n",
+                                              "<test>", Py_file_input);
+        assert(compiled != _Py_NULL);
+        PyCodeObject *codes[2] = {code, (PyCodeObject*)compiled};
+        for (int i=0; i < 2; i++) {
+            PyObject *co_code = PyCode_GetCode(codes[i]);
+            assert(co_code != _Py_NULL);
+            int size = (int)PyBytes_GET_SIZE(co_code);
+            Py_DECREF(co_code);
+
+            // the second pass uses the cache
+            for (int pass=0; pass < 2; pass++) {
+                // PyCode_Addr2Line() asserts that the offset is in range
+                // in debug mode
+                for (int addr=0; addr < size; addr += 2) {
+                    assert(_PyCode_Addr2LineCached(codes[i], addr)
+                           == PyCode_Addr2Line(codes[i], addr));
+                }
+            }
+
+            if (i == 1) {
+                PyCodeObject *co = codes[i];
+                // negative offset: first line
+                assert(_PyCode_Addr2LineCached(co, -2) == 1);
+#ifdef _PYTHONCAPI_COMPAT_CODE_EXTRA
+                // offset after the end: the line of the last instruction
+                // on Python 3.9 and older, -1 on Python 3.10 and newer
+#if PY_VERSION_HEX >= 0x030A0000
+                int last_line = -1;
+#else
+                int last_line = 5;
+#endif
+                assert(_PyCode_Addr2LineCached(co, size) == last_line);
+                assert(_PyCode_Addr2LineCached(co, size + 2) == last_line);
+#endif
+            }
+        }
+#ifdef _PYTHONCAPI_COMPAT_CODE_EXTRA
+        assert(_PyCode_GetLineTable(code) != _Py_NULL);
+#endif
+        Py_DECREF(compiled);
+    }
+
     Py_DECREF(code);
     Py_DECREF(frame);
     Py_RETURN_NONE;
@@ -795,6 +930,28 @@ func_varargs(PyObject *Py_UNUSED(module), PyObject *args, PyObject *kwargs)
 }
 
 
+#if PY_VERSION_HEX >= 0x030700A1 && !defined(PYPY_VERSION)
+#define TEST_FASTCALL
+
+static PyObject *
+func_fastcall(PyObject *Py_UNUSED(module), PyObject *const *args,
+              Py_ssize_t nargs, PyObject *kwnames)
+{
+    // Return (args, kwnames): args includes keyword argument values
+    if (kwnames != _Py_NULL) {
+        nargs += PyTuple_GET_SIZE(kwnames);
+    }
+    PyObject *args_tuple = PyTuple_FromArray(args, nargs);
+    if (args_tuple == _Py_NULL) {
+        return _Py_NULL;
+    }
+    PyObject *res = PyTuple_Pack(2, args_tuple, kwnames ? kwnames : Py_None);
+    Py_DECREF(args_tuple);
+    return res;
+}
+#endif
+
+
 static void
 check_int(PyObject *obj, int value)
 {
@@ -838,10 +995,35 @@ test_weakref(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
     assert(Py_REFCNT(obj) == (refcnt + 1));
     Py_DECREF(ref);
 
+    // test _PyWeakref_GetRefs()
+    PyObject *refs[3] = {weakref, Py_None, weakref};
+    PyObject *objs[3] = {UNINITIALIZED_OBJ, UNINITIALIZED_OBJ, UNINITIALIZED_OBJ};
+    assert(_PyWeakref_GetRefs(refs, 1, objs) == 1);
+    assert(objs[0] == obj);
+    Py_DECREF(objs[0]);
+
+    // test _PyWeakref_GetRefs(), invalid type: release references
+    objs[0] = objs[1] = objs[2] = UNINITIALIZED_OBJ;
+    assert(_PyWeakref_GetRefs(refs, 3, objs) == -1);
+    assert(PyErr_ExceptionMatches(PyExc_TypeError));
+    PyErr_Clear();
+    assert(objs[0] == _Py_NULL);
+    assert(objs[1] == _Py_NULL);
+    assert(objs[2] == _Py_NULL);
+    assert(Py_REFCNT(obj) == refcnt);
+
     // delete the referenced object: clear the weakref
     Py_DECREF(obj);
     gc_collect();
 
+    // test _PyWeakref_GetRefs(), dead reference
+    refs[1] = weakref;
+    objs[0] = objs[1] = objs[2] = UNINITIALIZED_OBJ;
+    assert(_PyWeakref_GetRefs(refs, 3, objs) == 0);
+    assert(objs[0] == _Py_NULL);
+    assert(objs[1] == _Py_NULL);
+    assert(objs[2] == _Py_NULL);
+
     // test PyWeakref_GetRef(), reference is dead
     ref = Py_True;
     assert(PyWeakref_GetRef(weakref, &ref) == 0);
@@ -1002,6 +1184,173 @@ test_vectorcall_args_kwnames(PyObject *func_varargs)
 }
 
 
+#ifdef TEST_FASTCALL
+static void
+test_vectorcall_fastcall(PyObject *func_fastcall)
+{
+    PyObject *args_tuple = Py_BuildValue("iii", 1, 2, 3);
+    assert(args_tuple != _Py_NULL);
+    PyObject **args = &PyTuple_GET_ITEM(args_tuple, 0);
+    PyObject *key = create_string("key");
+    PyObject *kwnames = PyTuple_Pack(1, key);
+    assert(kwnames != _Py_NULL);
+
+    PyObject *res = PyObject_Vectorcall(func_fastcall, args, 2, kwnames);
+    assert(res != _Py_NULL);
+    assert(PyTuple_Check(res));
+    assert(PyTuple_GET_SIZE(res) == 2);
+
+    PyObject *call_args = PyTuple_GET_ITEM(res, 0);
+    assert(PyTuple_Check(call_args));
+    assert(PyTuple_GET_SIZE(call_args) == 3);
+    check_int(PyTuple_GET_ITEM(call_args, 0), 1);
+    check_int(PyTuple_GET_ITEM(call_args, 1), 2);
+    check_int(PyTuple_GET_ITEM(call_args, 2), 3);
+    assert(PyTuple_GET_ITEM(res, 1) == kwnames);
+    Py_DECREF(res);
+
+    res = PyObject_Vectorcall(func_fastcall, args,
+                              1 | PY_VECTORCALL_ARGUMENTS_OFFSET, _Py_NULL);
+    assert(res != _Py_NULL);
+    call_args = PyTuple_GET_ITEM(res, 0);
+    assert(PyTuple_GET_SIZE(call_args) == 1);
+    check_int(PyTuple_GET_ITEM(call_args, 0), 1);
+    assert(PyTuple_GET_ITEM(res, 1) == Py_None);
+    Py_DECREF(res);
+
+    Py_DECREF(args_tuple);
+    Py_DECREF(kwnames);
+    Py_DECREF(key);
+}
+#endif
+
+
+static void
+test_vectorcall_pack_args(void)
+{
+    PyObject *args_tuple = Py_BuildValue("iii", 1, 2, 3);
+    assert(args_tuple != _Py_NULL);
+    PyObject **args = &PyTuple_GET_ITEM(args_tuple, 0);
+    PyObject *key = create_string("key");
+    PyObject *kwnames = PyTuple_Pack(1, key);
+    assert(kwnames != _Py_NULL);
+    PyObject *posargs, *kwargs;
+
+    // test _PyVectorcall_PackArgs(): positional arguments only
+    posargs = kwargs = UNINITIALIZED_OBJ;
+    assert(_PyVectorcall_PackArgs(args, 3 | PY_VECTORCALL_ARGUMENTS_OFFSET,
+                                  _Py_NULL, &posargs, &kwargs) == 0);
+    assert(PyTuple_Check(posargs));
+    assert(PyTuple_GET_SIZE(posargs) == 3);
+    check_int(PyTuple_GET_ITEM(posargs, 2), 3);
+    assert(kwargs == _Py_NULL);
+    Py_DECREF(posargs);
+
+    // test _PyVectorcall_PackArgs(): keyword arguments
+    posargs = kwargs = UNINITIALIZED_OBJ;
+    assert(_PyVectorcall_PackArgs(args, 2, kwnames, &posargs, &kwargs) == 0);
+    assert(PyTuple_GET_SIZE(posargs) == 2);
+    check_int(PyTuple_GET_ITEM(posargs, 0), 1);
+    check_int(PyTuple_GET_ITEM(posargs, 1), 2);
+    assert(PyDict_Check(kwargs));
+    assert(PyDict_Size(kwargs) == 1);
+    check_int(PyDict_GetItem(kwargs, key), 3);
+    Py_DECREF(posargs);
+    Py_DECREF(kwargs);
+
+    // test _PyVectorcall_PackArgs(): invalid kwnames
+    posargs = kwargs = UNINITIALIZED_OBJ;
+    assert(_PyVectorcall_PackArgs(args, 2, key, &posargs, &kwargs) == -1);
+    assert(PyErr_ExceptionMatches(PyExc_SystemError));
+    PyErr_Clear();
+    assert(posargs == _Py_NULL);
+    assert(kwargs == _Py_NULL);
+
+    Py_DECREF(args_tuple);
+    Py_DECREF(kwnames);
+    Py_DECREF(key);
+}
+
+
+static void
+test_vectorcall_method(void)
+{
+    PyObject *name = create_string("append");
+    PyObject *list = PyList_New(0);
+    assert(list != _Py_NULL);
+    PyObject *item = PyList_New(0);
+    assert(item != _Py_NULL);
+    PyObject *args[2] = {list, item};
+
+    // test PyObject_VectorcallMethod()
+    PyObject *res = PyObject_VectorcallMethod(name, args, 2, _Py_NULL);
+    assert(res == Py_None);
+    Py_DECREF(res);
+    assert(PyList_GET_SIZE(list) == 1);
+    assert(PyList_GET_ITEM(list, 0) == item);
+
+    // test PyObject_VectorcallMethod(): missing method
+    PyObject *missing = create_string("missing");
+    res = PyObject_VectorcallMethod(missing, args, 2, _Py_NULL);
+    assert(res == _Py_NULL);
+    assert(PyErr_ExceptionMatches(PyExc_AttributeError));
+    PyErr_Clear();
+
+    // test _PyObject_VectorcallMethodCached()
+    _PyObject_MethodCache cache = {_Py_NULL, 0, _Py_NULL, _Py_NULL};
+    for (int i=0; i < 2; i++) {
+        res = _PyObject_VectorcallMethodCached(&cache, name, args, 2, _Py_NULL);
+        assert(res == Py_None);
+        Py_DECREF(res);
+    }
+    assert(PyList_GET_SIZE(list) == 3);
+#ifdef _PYTHONCAPI_COMPAT_TYPE_CACHE
+    assert(cache.type == &PyList_Type);
+    assert(cache.name == name);
+    assert(cache.method != _Py_NULL);
+#endif
+
+    // test _PyObject_VectorcallMethodCached(): missing method
+    res = _PyObject_VectorcallMethodCached(&cache, missing, args, 2, _Py_NULL);
+    assert(res == _Py_NULL);
+    assert(PyErr_ExceptionMatches(PyExc_AttributeError));
+    PyErr_Clear();
+
+    // test _PyObject_VectorcallMethodCached(): instance attribute shadows
+    // the method
+    PyObject *sub_type = PyObject_CallFunction((PyObject*)&PyType_Type,
+                                               "s(O){}", "ListSubclass",
+                                               (PyObject*)&PyList_Type);
+    assert(sub_type != _Py_NULL);
+    PyObject *sub = PyObject_CallNoArgs(sub_type);
+    assert(sub != _Py_NULL);
+    PyObject *sub_args[2] = {sub, item};
+    res = _PyObject_VectorcallMethodCached(&cache, name, sub_args, 2, _Py_NULL);
+    assert(res == Py_None);
+    Py_DECREF(res);
+    assert(PyList_GET_SIZE(sub) == 1);
+
+    assert(PyObject_SetAttr(sub, name, (PyObject*)&PyTuple_Type) == 0);
+    res = _PyObject_VectorcallMethodCached(&cache, name, sub_args, 2, _Py_NULL);
+    assert(res != _Py_NULL);
+    assert(PyTuple_CheckExact(res));
+    Py_DECREF(res);
+    assert(PyList_GET_SIZE(sub) == 1);
+
+    _PyObject_MethodCache_Clear(&cache);
+    assert(cache.type == _Py_NULL);
+    assert(cache.name == _Py_NULL);
+    assert(cache.method == _Py_NULL);
+
+    Py_DECREF(sub);
+    Py_DECREF(sub_type);
+    Py_DECREF(missing);
+    Py_DECREF(item);
+    Py_DECREF(list);
+    Py_DECREF(name);
+}
+
+
 static PyObject *
 test_vectorcall(PyObject *module, PyObject *Py_UNUSED(args))
 {
@@ -1023,11 +1372,110 @@ test_vectorcall(PyObject *module, PyObject *Py_UNUSED(args))
     test_vectorcall_args_offset(func_varargs);
     test_vectorcall_args_kwnames(func_varargs);
 
+#ifdef TEST_FASTCALL
+    // test PyObject_Vectorcall() on a METH_FASTCALL function
+    PyObject *func_fastcall = PyObject_GetAttrString(module, "func_fastcall");
+    if (func_fastcall == _Py_NULL) {
+        Py_DECREF(func_varargs);
+        return _Py_NULL;
+    }
+    test_vectorcall_fastcall(func_fastcall);
+    Py_DECREF(func_fastcall);
+#endif
+
+    // test _PyVectorcall_PackArgs()
+    test_vectorcall_pack_args();
+
+    // test PyObject_VectorcallMethod() and _PyObject_VectorcallMethodCached()
+    test_vectorcall_method();
+
     Py_DECREF(func_varargs);
     Py_RETURN_NONE;
 }
 
 
+static void
+test_getattr_cached(void)
+{
+    _PyObject_AttrCache cache = {_Py_NULL, 0, _Py_NULL, _Py_NULL};
+    PyObject *list = PyList_New(0);
+    assert(list != _Py_NULL);
+    PyObject *missing_attr = create_string("__fspath__");
+    PyObject *method_name = create_string("append");
+    PyObject *class_name = create_string("__class__");
+    PyObject *value;
+
+    // test _PyObject_GetOptionalAttrCached(): attribute doesn't exist
+    for (int i=0; i < 2; i++) {
+        value = UNINITIALIZED_OBJ;
+        assert(_PyObject_GetOptionalAttrCached(&cache, list, missing_attr,
+                                               &value) == 0);
+        assert(!PyErr_Occurred());
+        assert(value == _Py_NULL);
+    }
+#ifdef _PYTHONCAPI_COMPAT_TYPE_CACHE
+    assert(cache.type == &PyList_Type);
+    assert(cache.name == missing_attr);
+    assert(cache.descr == _Py_NULL);
+#endif
+
+    // test _PyObject_GetOptionalAttrCached(): method
+    for (int i=0; i < 2; i++) {
+        value = UNINITIALIZED_OBJ;
+        assert(_PyObject_GetOptionalAttrCached(&cache, list, method_name,
+                                               &value) == 1);
+        assert(value != _Py_NULL);
+        assert(PyCallable_Check(value));
+        Py_DECREF(value);
+    }
+
+    // test _PyObject_GetOptionalAttrCached(): data descriptor
+    value = UNINITIALIZED_OBJ;
+    assert(_PyObject_GetOptionalAttrCached(&cache, list, class_name,
+                                           &value) == 1);
+    assert(value == (PyObject*)&PyList_Type);
+    Py_DECREF(value);
+
+    // test _PyObject_GetOptionalAttrCached(): instance attribute
+    PyObject *sub_type = PyObject_CallFunction((PyObject*)&PyType_Type,
+                                               "s(O){}", "ListSubclass",
+                                               (PyObject*)&PyList_Type);
+    assert(sub_type != _Py_NULL);
+    PyObject *sub = PyObject_CallNoArgs(sub_type);
+    assert(sub != _Py_NULL);
+    value = UNINITIALIZED_OBJ;
+    assert(_PyObject_GetOptionalAttrCached(&cache, sub, missing_attr,
+                                           &value) == 0);
+    assert(value == _Py_NULL);
+    assert(PyObject_SetAttr(sub, missing_attr, Py_None) == 0);
+    value = UNINITIALIZED_OBJ;
+    assert(_PyObject_GetOptionalAttrCached(&cache, sub, missing_attr,
+                                           &value) == 1);
+    assert(value == Py_None);
+    Py_DECREF(value);
+
+    // test _PyObject_GetOptionalAttrCached(): class attribute
+    assert(PyObject_SetAttr(sub_type, method_name, Py_True) == 0);
+    value = UNINITIALIZED_OBJ;
+    assert(_PyObject_GetOptionalAttrCached(&cache, sub, method_name,
+                                           &value) == 1);
+    assert(value == Py_True);
+    Py_DECREF(value);
+
+    _PyObject_AttrCache_Clear(&cache);
+    assert(cache.type == _Py_NULL);
+    assert(cache.name == _Py_NULL);
+    assert(cache.descr == _Py_NULL);
+
+    Py_DECREF(sub);
+    Py_DECREF(sub_type);
+    Py_DECREF(class_name);
+    Py_DECREF(method_name);
+    Py_DECREF(missing_attr);
+    Py_DECREF(list);
+}
+
+
 static PyObject *
 test_getattr(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
 {
@@ -1082,6 +1530,9 @@ test_getattr(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
     assert(PyObject_HasAttrStringWithError(obj, "nonexistant_attr_name") == 0);
     assert(!PyErr_Occurred());
 
+    // test _PyObject_GetOptionalAttrCached()
+    test_getattr_cached();
+
     Py_DECREF(attr_name);
     Py_DECREF(missing_attr);
     Py_DECREF(obj);
@@ -1402,6 +1853,67 @@ test_dict_setdefault(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
 }
 
 
+static PyObject *
+test_dict_known_hash(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
+{
+    PyObject *dict = PyDict_New();
+    if (dict == NULL) {
+        return NULL;
+    }
+    PyObject *key = create_string("key");
+    PyObject *value = create_string("abc");
+    PyObject *result;
+    Py_hash_t hash = PyObject_Hash(key);
+    assert(hash != -1);
+
+    // test _PyDict_KnownHash_GetItemRef(): missing key
+    result = UNINITIALIZED_OBJ;
+    assert(_PyDict_KnownHash_GetItemRef(dict, key, hash, &result) == 0);
+    assert(result == NULL);
+    assert(!PyErr_Occurred());
+
+    // test _PyDict_KnownHash_SetItem()
+    assert(_PyDict_KnownHash_SetItem(dict, key, hash, value) == 0);
+    assert(PyDict_GetItem(dict, key) == value);
+
+    // test _PyDict_KnownHash_GetItemRef(): key is present
+    result = UNINITIALIZED_OBJ;
+    assert(_PyDict_KnownHash_GetItemRef(dict, key, hash, &result) == 1);
+    assert(result == value);
+    Py_DECREF(result);
+
+    // test _PyDict_KnownHash_Pop(): key is present
+    result = UNINITIALIZED_OBJ;
+    assert(_PyDict_KnownHash_Pop(dict, key, hash, &result) == 1);
+    assert(result == value);
+    Py_DECREF(result);
+    assert(PyDict_Size(dict) == 0);
+
+    // test _PyDict_KnownHash_Pop(): missing key
+    result = UNINITIALIZED_OBJ;
+    assert(_PyDict_KnownHash_Pop(dict, key, hash, &result) == 0);
+    assert(result == NULL);
+    assert(!PyErr_Occurred());
+
+    // test _PyDict_KnownHash_Pop(): NULL result
+    assert(_PyDict_KnownHash_SetItem(dict, key, hash, value) == 0);
+    assert(_PyDict_KnownHash_Pop(dict, key, hash, NULL) == 1);
+    assert(_PyDict_KnownHash_Pop(dict, key, hash, NULL) == 0);
+
+    // test _PyDict_KnownHash_GetItemRef(): invalid dict
+    result = UNINITIALIZED_OBJ;
+    assert(_PyDict_KnownHash_GetItemRef(key, key, hash, &result) == -1);
+    assert(result == NULL);
+    assert(PyErr_ExceptionMatches(PyExc_SystemError));
+    PyErr_Clear();
+
+    Py_DECREF(dict);
+    Py_DECREF(key);
+    Py_DECREF(value);
+    Py_RETURN_NONE;
+}
+
+
 static PyObject *
 test_long_api(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
 {
@@ -1615,6 +2127,47 @@ test_unicode(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
     assert(PyErr_ExceptionMatches(PyExc_MemoryError));
     PyErr_Clear();
 
+#if PY_VERSION_HEX >= 0x03030000
+    // Test PyUnicode_EqualToUTF8AndSize() with non-ASCII strings:
+    // UCS1, UCS2, UCS4 and a surrogate character
+    {
+        PyObject *ucs1 = PyUnicode_FromString("caf\xc3\xa9");
+        assert(ucs1 != NULL);
+        PyObject *ucs2 = PyUnicode_FromString("1\xe2\x82\xac");
+        assert(ucs2 != NULL);
+        PyObject *ucs4 = PyUnicode_FromString("\xf0\x9f\x90\x8d!");
+        assert(ucs4 != NULL);
+        PyObject *surrogate = PyUnicode_DecodeUTF8("a\xff", 2, "surrogateescape");
+        assert(surrogate != NULL);
+
+        assert(PyUnicode_EqualToUTF8(ucs1, "caf\xc3\xa9") == 1);
+        assert(PyUnicode_EqualToUTF8(ucs1, "caf\xc3\xa8") == 0);
+        assert(PyUnicode_EqualToUTF8(ucs1, "caf\xc3") == 0);
+        assert(PyUnicode_EqualToUTF8(ucs1, "cafe") == 0);
+        assert(PyUnicode_EqualToUTF8(ucs1, "caf\xc3\xa9!") == 0);
+        assert(PyUnicode_EqualToUTF8(ucs2, "1\xe2\x82\xac") == 1);
+        assert(PyUnicode_EqualToUTF8(ucs2, "1\xe2\x82") == 0);
+        assert(PyUnicode_EqualToUTF8(ucs4, "\xf0\x9f\x90\x8d!") == 1);
+        assert(PyUnicode_EqualToUTF8(ucs4, "\xf0\x9f\x90\x8d?") == 0);
+        assert(PyUnicode_EqualToUTF8AndSize(ucs4, "\xf0\x9f\x90\x8d", 4) == 0);
+        assert(PyUnicode_EqualToUTF8(surrogate, "a\xed\xb3\xbf") == 0);
+        assert(PyUnicode_EqualToUTF8(surrogate, "a") == 0);
+        assert(!PyErr_Occurred());
+
+        // The current exception is not cleared
+        PyErr_NoMemory();
+        assert(PyUnicode_EqualToUTF8(ucs2, "1\xe2\x82\xac") == 1);
+        assert(PyUnicode_EqualToUTF8(surrogate, "a") == 0);
+        assert(PyErr_ExceptionMatches(PyExc_MemoryError));
+        PyErr_Clear();
+
+        Py_DECREF(ucs1);
+        Py_DECREF(ucs2);
+        Py_DECREF(ucs4);
+        Py_DECREF(surrogate);
+    }
+#endif
+
     // Test PyUnicode_Equal()
     assert(PyUnicode_Equal(abc, abc) == 1);
     assert(PyUnicode_Equal(abc, abc0def) == 0);
@@ -1637,6 +2190,66 @@ test_unicode(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
 }
 
 
+#if PY_VERSION_HEX >= 0x03030000
+static PyObject *
+test_kwtable(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
+{
+    static const char * const names[] = {"key", "caf\xc3\xa9", "", "keys"};
+    _PyKwTable table = {names, 4, _Py_NULL, _Py_NULL, _Py_NULL, 0};
+    Py_ssize_t indices[5];
+
+    PyObject *key = PyUnicode_InternFromString("key");
+    assert(key != _Py_NULL);
+    // not interned
+    PyObject *keys = PyUnicode_FromStringAndSize("keysx", 4);
+    assert(keys != _Py_NULL);
+    PyObject *cafe = PyUnicode_FromString("caf\xc3\xa9");
+    assert(cafe != _Py_NULL);
+    PyObject *empty = PyUnicode_FromString("");
+    assert(empty != _Py_NULL);
+    PyObject *unknown = PyUnicode_FromString("ke");
+    assert(unknown != _Py_NULL);
+    PyObject *kwnames = PyTuple_Pack(5, unknown, keys, cafe, key, empty);
+    assert(kwnames != _Py_NULL);
+
+    // test _PyKwTable_Match(), the second call uses the cache
+    for (int i=0; i < 2; i++) {
+        memset(indices, 0xff, sizeof(indices));
+        assert(_PyKwTable_Match(&table, kwnames, indices) == 0);
+        assert(indices[0] == -1);
+        assert(indices[1] == 3);
+        assert(indices[2] == 1);
+        assert(indices[3] == 0);
+        assert(indices[4] == 2);
+    }
+
+    // test _PyKwTable_Match(): other kwnames
+    PyObject *kwnames2 = PyTuple_Pack(2, key, keys);
+    assert(kwnames2 != _Py_NULL);
+    assert(_PyKwTable_Match(&table, kwnames2, indices) == 0);
+    assert(indices[0] == 0);
+    assert(indices[1] == 3);
+    Py_DECREF(kwnames2);
+
+    // test _PyKwTable_Match(): no keywords
+    assert(_PyKwTable_Match(&table, _Py_NULL, indices) == 0);
+
+    _PyKwTable_Clear(&table);
+    assert(table.interned == _Py_NULL);
+    assert(table.kwnames == _Py_NULL);
+    assert(table.indices == _Py_NULL);
+
+    Py_DECREF(kwnames);
+    Py_DECREF(key);
+    Py_DECREF(keys);
+    Py_DECREF(cafe);
+    Py_DECREF(empty);
+    Py_DECREF(unknown);
+    Py_RETURN_NONE;
+}
+#endif
+
+
 static PyObject *
 test_list(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
 {
@@ -2453,10 +3066,58 @@ error:
 }
 
 
+static PyObject*
+test_tuple_fromarray_stealref(void)
+{
+    PyObject *one = PyLong_FromLong(1);
+    if (one == NULL) {
+        return NULL;
+    }
+    PyObject *two = PyList_New(0);
+    if (two == NULL) {
+        Py_DECREF(one);
+        return NULL;
+    }
+    Py_ssize_t refcnt = Py_REFCNT(two);
+
+    // _PyTuple_FromArrayStealRef() steals references to items
+    PyObject* array[] = {one, Py_NewRef(two)};
+    PyObject *tuple = _PyTuple_FromArrayStealRef(array, 2);
+    if (tuple == NULL) {
+        Py_DECREF(two);
+        return NULL;
+    }
+    assert(PyTuple_GET_SIZE(tuple) == 2);
+    assert(PyTuple_GET_ITEM(tuple, 0) == one);
+    assert(PyTuple_GET_ITEM(tuple, 1) == two);
+    ASSERT_REFCNT(Py_REFCNT(two) == refcnt + 1);
+
+    Py_DECREF(tuple);
+    ASSERT_REFCNT(Py_REFCNT(two) == refcnt);
+    Py_DECREF(two);
+
+    // Test _PyTuple_FromArrayStealRef(NULL, 0)
+    tuple = _PyTuple_FromArrayStealRef(NULL, 0);
+    if (tuple == NULL) {
+        return NULL;
+    }
+    assert(PyTuple_GET_SIZE(tuple) == 0);
+    Py_DECREF(tuple);
+
+    Py_RETURN_NONE;
+}
+
+
 static PyObject*
 test_tuple(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
 {
-    return test_tuple_fromarray();
+    PyObject *res = test_tuple_fromarray();
+    if (res == NULL) {
+        return NULL;
+    }
+    Py_DECREF(res);
+
+    return test_tuple_fromarray_stealref();
 }
 
 // Test adapted from CPython's _testcapi/object.c
@@ -2496,6 +3157,29 @@ test_try_incref(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
     Py_DECREF(obj);
 
     assert(TryIncref_dealloc_called == 1);
+
+    // Test PyUnstable_Object_EnableDeferredRefcount()
+    PyObject *list = PyList_New(0);
+    if (list == _Py_NULL) {
+        return _Py_NULL;
+    }
+#if defined(Py_GIL_DISABLED) && !defined(PYPY_VERSION)
+    assert(PyUnstable_Object_EnableDeferredRefcount(list) == 1);
+#else
+    assert(PyUnstable_Object_EnableDeferredRefcount(list) == 0);
+#endif
+    // Already enabled or not supported
+    assert(PyUnstable_Object_EnableDeferredRefcount(list) == 0);
+    Py_DECREF(list);
+
+    // Not supported on objects not tracked by the GC
+    PyObject *value = PyFloat_FromDouble(1.5);
+    if (value == _Py_NULL) {
+        return _Py_NULL;
+    }
+    assert(PyUnstable_Object_EnableDeferredRefcount(value) == 0);
+    Py_DECREF(value);
+
     Py_RETURN_NONE;
 }
 
@@ -2528,6 +3212,60 @@ test_set_immortal(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
     rc = PyUnstable_SetImmortal(unicode);
     assert(rc == 0);
     Py_DECREF(unicode);
+
+    // Test _PyObject_SetImmortalTree(): reject mutable objects
+    PyObject *list = PyList_New(0);
+    assert(list != _Py_NULL);
+    PyObject *tuple = PyTuple_Pack(1, list);
+    assert(tuple != _Py_NULL);
+    Py_DECREF(list);
+    assert(_PyObject_SetImmortalTree(tuple, _Py_NULL) == -1);
+    assert(PyErr_ExceptionMatches(PyExc_TypeError));
+    PyErr_Clear();
+    assert(!_Py_IsImmortal(tuple));
+    Py_DECREF(tuple);
+
+#ifndef Py_REF_DEBUG
+    // Objects made immortal are leaked on purpose, which would be reported
+    // as a reference leak in debug mode.
+    PyObject *shared = PyFloat_FromDouble(2.5);
+    assert(shared != _Py_NULL);
+    PyObject *items = PyList_New(2);
+    assert(items != _Py_NULL);
+    PyList_SET_ITEM(items, 0, PyLong_FromString("123456789012345678901234567890", _Py_NULL, 10));
+    PyList_SET_ITEM(items, 1, PyBytes_FromString("bytes"));
+    PyObject *frozenset = PyFrozenSet_New(items);
+    assert(frozenset != _Py_NULL);
+    Py_DECREF(items);
+    PyObject *inner = PyTuple_New(2);
+    assert(inner != _Py_NULL);
+    PyTuple_SET_ITEM(inner, 0, PyFloat_FromDouble(1.5));
+    PyTuple_SET_ITEM(inner, 1, Py_NewRef(shared));
+    PyObject *root = PyTuple_New(5);
+    assert(root != _Py_NULL);
+    PyTuple_SET_ITEM(root, 0, frozenset);
+    PyTuple_SET_ITEM(root, 1, inner);
+    PyTuple_SET_ITEM(root, 2, PyUnicode_FromString("not immortal"));
+    PyTuple_SET_ITEM(root, 3, shared);
+    PyTuple_SET_ITEM(root, 4, Py_NewRef(Py_None));
+
+    PyObject *skipped = PyList_New(0);
+    assert(skipped != _Py_NULL);
+    // root, frozenset, its 2 items, inner and its float
+    assert(_PyObject_SetImmortalTree(root, skipped) == 6);
+    assert(_Py_IsImmortal(root));
+    assert(_Py_IsImmortal(frozenset));
+    assert(_Py_IsImmortal(inner));
+    assert(_Py_IsImmortal(PyTuple_GET_ITEM(inner, 0)));
+    // The shared float (twice) and the str object are skipped
+    assert(PyList_GET_SIZE(skipped) == 3);
+    assert(PyList_GET_ITEM(skipped, 0) == shared);
+    assert(PyUnicode_Check(PyList_GET_ITEM(skipped, 1)));
+    assert(PyList_GET_ITEM(skipped, 2) == shared);
+    assert(!_Py_IsImmortal(shared));
+    Py_DECREF(skipped);
+    Py_DECREF(root);  // should not dealloc
+#endif
     Py_RETURN_NONE;
 }
 #endif
@@ -2554,17 +3292,24 @@ static struct PyMethodDef methods[] = {
     {"test_import", test_import, METH_NOARGS, _Py_NULL},
     {"test_weakref", test_weakref, METH_NOARGS, _Py_NULL},
     {"func_varargs", (PyCFunction)(void*)func_varargs, METH_VARARGS | METH_KEYWORDS, _Py_NULL},
+#ifdef TEST_FASTCALL
+    {"func_fastcall", (PyCFunction)(void*)func_fastcall, METH_FASTCALL | METH_KEYWORDS, _Py_NULL},
+#endif
     {"test_vectorcall", test_vectorcall, METH_NOARGS, _Py_NULL},
     {"test_getattr", test_getattr, METH_NOARGS, _Py_NULL},
     {"test_getitem", test_getitem, METH_NOARGS, _Py_NULL},
     {"test_dict_api", test_dict_api, METH_NOARGS, _Py_NULL},
     {"test_dict_pop", test_dict_pop, METH_NOARGS, _Py_NULL},
     {"test_dict_setdefault", test_dict_setdefault, METH_NOARGS, _Py_NULL},
+    {"test_dict_known_hash", test_dict_known_hash, METH_NOARGS, _Py_NULL},
     {"test_long_api", test_long_api, METH_NOARGS, _Py_NULL},
 #ifdef TEST_MANAGED_DICT
     {"test_managed_dict", test_managed_dict, METH_NOARGS, _Py_NULL},
 #endif
     {"test_unicode", test_unicode, METH_NOARGS, _Py_NULL},
+#if PY_VERSION_HEX >= 0x03030000
+    {"test_kwtable", test_kwtable, METH_NOARGS, _Py_NULL},
+#endif
     {"test_list", test_list, METH_NOARGS, _Py_NULL},
     {"test_hash", test_hash, METH_NOARGS, _Py_NULL},
 #ifdef TEST_PYTIME
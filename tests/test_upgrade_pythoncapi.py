@@ -1,10 +1,17 @@
 #!/usr/bin/env python3
+import hashlib
 import io
+import json
 import os
+import shutil
+import signal
+import subprocess
 import sys
 import tempfile
 import textwrap
+import time
 import unittest
+from unittest import mock
 
 # Get upgrade_pythoncapi.py of the parent directory
 sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
@@ -135,6 +142,637 @@ class Tests(unittest.TestCase):
         new_contents = self._patch_file(source)
         self.assertEqual(new_contents, expected)
 
+    def run_main(self, *args):
+        # Run Patcher.main(): return the exit code and stderr
+        old_stderr = sys.stderr
+        try:
+            sys.stderr = io.StringIO()
+            try:
+                upgrade_pythoncapi.Patcher(list(args)).main()
+            except SystemExit as exc:
+                exitcode = exc.code
+            else:
+                self.fail("SystemExit not raised")
+            return (exitcode, sys.stderr.getvalue())
+        finally:
+            sys.stderr = old_stderr
+
+    def test_jobs(self):
+        source = reformat("""
+            Py_ssize_t get_size(PyVarObject *obj)
+            { return obj->ob_size; }
+        """)
+        expected = reformat("""
+            Py_ssize_t get_size(PyVarObject *obj)
+            { return Py_SIZE(obj); }
+        """)
+        unchanged = "int x;\n"
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            filenames = []
+            for index in range(50):
+                filename = os.path.join(tmp_dir, f"mod{index}.c")
+                with open(filename, "w", encoding="utf-8") as fp:
+                    fp.write(unchanged if index % 3 else source)
+                filenames.append(filename)
+            missing = os.path.join(tmp_dir, "missing.c")
+            empty_dir = os.path.join(tmp_dir, "empty")
+            os.mkdir(empty_dir)
+
+            # Run sequentially, then restore the files
+            args = ('-B', '-o', 'Py_SIZE', missing, tmp_dir, empty_dir)
+            seq_exitcode, seq_stderr = self.run_main('-j', '1', *args)
+            for index, filename in enumerate(filenames):
+                with open(filename, "w", encoding="utf-8") as fp:
+                    fp.write(unchanged if index % 3 else source)
+
+            exitcode, stderr = self.run_main('-j', '4', *args)
+            self.assertEqual(exitcode, 1)
+            # Same messages in the same order than in sequential mode
+            self.assertEqual((exitcode, stderr), (seq_exitcode, seq_stderr))
+
+            patched = [filename for index, filename in enumerate(filenames)
+                       if not index % 3]
+            for filename in filenames:
+                with open(filename, encoding="utf-8") as fp:
+                    contents = fp.read()
+                if filename in patched:
+                    self.assertEqual(contents, expected)
+                else:
+                    self.assertEqual(contents, unchanged)
+
+            # Messages are logged in the order of the walk
+            walk = upgrade_pythoncapi.Patcher(['-o', 'Py_SIZE', tmp_dir])
+            ordered = [filename for filename in walk.walk([tmp_dir])
+                       if filename in patched]
+
+        self.assertEqual(len(ordered), len(patched))
+        lines = stderr.splitlines()
+        self.assertEqual([line for line in lines
+                          if line.startswith("Patched file: ")],
+                         [f"Patched file: {filename} (Py_SIZE)"
+                          for filename in ordered])
+        self.assertEqual(lines[0], f"WARNING: Path {missing} does not exist")
+        self.assertIn(f"WARNING: Directory {empty_dir} doesn't contain "
+                      f"any C file", lines)
+        self.assertIn("Applied operations (1): Py_SIZE", lines)
+
+    def test_cache(self):
+        source = "int x = obj->ob_size;\n"
+        expected = "int x = Py_SIZE(obj);\n"
+        unchanged = "int x;\n"
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            cache = os.path.join(tmp_dir, "cache.json")
+            src_dir = os.path.join(tmp_dir, "src")
+            os.mkdir(src_dir)
+            patched = os.path.join(src_dir, "patched.c")
+            with open(patched, "w", encoding="utf-8") as fp:
+                fp.write(source)
+            for index in range(3):
+                filename = os.path.join(src_dir, f"mod{index}.c")
+                with open(filename, "w", encoding="utf-8") as fp:
+                    fp.write(unchanged)
+
+            args = ['-B', '-o', 'Py_SIZE', '--cache', cache, src_dir]
+            exitcode, stderr = self.run_main(*args)
+            self.assertEqual(exitcode, 0)
+            with open(patched, encoding="utf-8") as fp:
+                self.assertEqual(fp.read(), expected)
+
+            # A run on a single file keeps hashes of other files
+            exitcode, stderr = self.run_main(
+                '-B', '-o', 'Py_SIZE', '--cache', cache,
+                os.path.join(src_dir, "mod0.c"))
+            self.assertEqual(exitcode, 0)
+
+            # Unchanged files are not patched again
+            with mock.patch.object(upgrade_pythoncapi.Patcher, '_patch',
+                                   side_effect=AssertionError) as mock_patch:
+                exitcode, stderr = self.run_main(*args)
+                exitcode, stderr = self.run_main('-j', '2', *args)
+            self.assertEqual(exitcode, 0)
+            self.assertEqual(mock_patch.call_count, 0)
+
+            # Modified file
+            with open(patched, "w", encoding="utf-8") as fp:
+                fp.write(source)
+            exitcode, stderr = self.run_main('-j', '2', *args)
+            self.assertEqual(exitcode, 0)
+            self.assertIn(f"Patched file: {patched} (Py_SIZE)",
+                          stderr.splitlines())
+
+            def cache_hashes():
+                with open(cache, encoding="utf-8") as fp:
+                    return set(json.load(fp)["clean"])
+
+            hashes = cache_hashes()
+            self.assertEqual(len(hashes), 2)
+            self.assertEqual(sorted(os.listdir(tmp_dir)), ["cache.json", "src"])
+
+            # Only hashes of files seen by the run are kept, except if only
+            # some files are checked
+            files_from = os.path.join(tmp_dir, "files.txt")
+            with open(files_from, "w", encoding="utf-8") as fp:
+                print(os.path.join(src_dir, "mod0.c"), file=fp)
+            os.unlink(patched)
+            exitcode, stderr = self.run_main('-B', '-o', 'Py_SIZE',
+                                             '--cache', cache,
+                                             '--files-from', files_from)
+            self.assertEqual(exitcode, 0)
+            self.assertEqual(cache_hashes(), hashes)
+
+            exitcode, stderr = self.run_main(*args)
+            self.assertEqual(exitcode, 0)
+            unchanged_hash = hashlib.sha256(unchanged.encode()).hexdigest()
+            self.assertEqual(cache_hashes(), {unchanged_hash})
+
+            # Different operations invalidate the cache
+            with mock.patch.object(upgrade_pythoncapi.Patcher, '_patch',
+                                   side_effect=lambda content: (content, [])
+                                   ) as mock_patch:
+                exitcode, stderr = self.run_main('-B', '-o', 'Py_TYPE',
+                                                 '--cache', cache, src_dir)
+            self.assertEqual(exitcode, 0)
+            self.assertEqual(mock_patch.call_count, 3)
+
+    def test_files_from(self):
+        source = "int x = obj->ob_size;\n"
+        expected = "int x = Py_SIZE(obj);\n"
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            filenames = []
+            for name in ("a.c", "b.c", "c.txt"):
+                filename = os.path.join(tmp_dir, name)
+                with open(filename, "w", encoding="utf-8") as fp:
+                    fp.write(source)
+                filenames.append(filename)
+            missing = os.path.join(tmp_dir, "missing.c")
+
+            for null in (False, True):
+                sep = "\0" if null else "\n"
+                data = sep.join(filenames[1:] + [missing]).encode()
+                old_stdin = sys.stdin
+                try:
+                    sys.stdin = io.TextIOWrapper(io.BytesIO(data))
+                    args = ['-B', '-o', 'Py_SIZE', '--files-from', '-']
+                    if null:
+                        args.append('-0')
+                    exitcode, stderr = self.run_main(*args)
+                finally:
+                    sys.stdin = old_stdin
+                self.assertEqual(exitcode, 1)
+                self.assertIn(f"WARNING: Path {missing} does not exist",
+                              stderr.splitlines())
+
+                contents = []
+                for filename in filenames:
+                    with open(filename, encoding="utf-8") as fp:
+                        contents.append(fp.read())
+                    with open(filename, "w", encoding="utf-8") as fp:
+                        fp.write(source)
+                # a.c is not listed, c.txt is not a C file
+                self.assertEqual(contents, [source, expected, source])
+
+    @unittest.skipIf(shutil.which("git") is None, "need git")
+    def test_git_diff(self):
+        source = "int x = obj->ob_size;\n"
+        expected = "int x = Py_SIZE(obj);\n"
+
+        def git(*args):
+            cmd = ["git", "-c", "user.name=test", "-c", "user.email=test@test",
+                   *args]
+            subprocess.run(cmd, cwd=tmp_dir, check=True,
+                           stdout=subprocess.DEVNULL)
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            for name in ("a.c", "b.c", "deleted.c"):
+                with open(os.path.join(tmp_dir, name), "w",
+                          encoding="utf-8") as fp:
+                    fp.write("int x;\n")
+            git("init", "-q")
+            git("add", ".")
+            git("commit", "-q", "-m", "init")
+            with open(os.path.join(tmp_dir, "b.c"), "w",
+                      encoding="utf-8") as fp:
+                fp.write(source)
+            with open(os.path.join(tmp_dir, "a.c"), "w",
+                      encoding="utf-8") as fp:
+                fp.write(source)
+            git("add", "a.c")
+            git("commit", "-q", "-m", "modify a.c")
+            os.unlink(os.path.join(tmp_dir, "deleted.c"))
+
+            old_cwd = os.getcwd()
+            try:
+                os.chdir(tmp_dir)
+                # b.c is modified but not committed
+                exitcode, stderr = self.run_main('-B', '-o', 'Py_SIZE',
+                                                 '--git-diff', 'HEAD')
+            finally:
+                os.chdir(old_cwd)
+            self.assertEqual(exitcode, 0, stderr)
+
+            contents = []
+            for name in ("a.c", "b.c"):
+                with open(os.path.join(tmp_dir, name), encoding="utf-8") as fp:
+                    contents.append(fp.read())
+            self.assertEqual(contents, [source, expected])
+
+    @unittest.skipUnless(hasattr(signal, 'setitimer'), "need setitimer()")
+    def test_timeout(self):
+        source = "int x = obj->ob_size;\n"
+
+        def slow_patch(content):
+            time.sleep(60)
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            filename = os.path.join(tmp_dir, "mod.c")
+            with open(filename, "w", encoding="utf-8") as fp:
+                fp.write(source)
+
+            with mock.patch.object(upgrade_pythoncapi.Py_SIZE, 'patch',
+                                   side_effect=slow_patch):
+                exitcode, stderr = self.run_main('-o', 'Py_SIZE',
+                                                 '--timeout', '0.1', filename)
+            self.assertEqual(exitcode, 1)
+            self.assertIn(f"WARNING: Skip {filename}: patching took longer "
+                          f"than 0.1 seconds", stderr.splitlines())
+            with open(filename, encoding="utf-8") as fp:
+                self.assertEqual(fp.read(), source)
+
+            # The timeout is not reached
+            exitcode, stderr = self.run_main('-B', '-o', 'Py_SIZE',
+                                             '--timeout', '60', filename)
+            self.assertEqual(exitcode, 0)
+            with open(filename, encoding="utf-8") as fp:
+                self.assertEqual(fp.read(), "int x = Py_SIZE(obj);\n")
+
+    def test_long_expressions(self):
+        # Regexes must not take quadratic time on long expressions
+        chain = "a->b." * 3000
+        sources = (
+            f"{chain}c->ob_typ;\n",
+            f"{chain}c == Py_Non;\n",
+            f"Py_INCREF({chain}c);\n{chain}d = e;\n",
+            "a[" * 3000 + "\n",
+            " && ".join(f"Py_TYPE(o) == &T{i}" for i in range(4000)) + ";\n",
+        )
+        for source in sources:
+            start = time.perf_counter()
+            self.assertEqual(patch(source), source)
+            self.assertLess(time.perf_counter() - start, 5.0)
+
+        self.check_replace(f"{chain}c == Py_None",
+                           f"Py_IsNone({chain}c)", no_compat=True)
+        # Don't replace "x" in "func()->x == Py_None"
+        self.check_dont_replace("func()->x == Py_None")
+
+    def test_chunk_size(self):
+        # Large files are patched window by window
+        func = textwrap.dedent("""
+            static PyObject* func{index}(PyObject *obj)
+            {{
+                /* Py_TYPE(obj) = type;
+
+                   obj->ob_size */
+                Py_TYPE(obj) = type;
+
+                Py_ssize_t size = obj->ob_size;
+                return obj;
+            }}
+        """)
+        source = '#include "Python.h"\n'
+        source += ''.join(func.format(index=index) for index in range(50))
+        expected = upgrade_pythoncapi.Patcher(['mod.c']).patch(source)
+        self.assertIn(upgrade_pythoncapi.INCLUDE_PYTHONCAPI_COMPAT, expected)
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            filename = os.path.join(tmp_dir, "mod.c")
+            for chunk_size in (1, 100, 1000, len(source) - 1):
+                with open(filename, "w", encoding="utf-8") as fp:
+                    fp.write(source)
+                os.chmod(filename, 0o640)
+
+                exitcode, stderr = self.run_main('--chunk-size',
+                                                 str(chunk_size), filename)
+                self.assertEqual(exitcode, 0)
+                self.assertIn(f"Patched file: {filename} (Py_SET_TYPE, Py_SIZE)",
+                              stderr.splitlines())
+                with open(filename, encoding="utf-8") as fp:
+                    self.assertEqual(fp.read(), expected)
+                with open(filename + ".old", encoding="utf-8") as fp:
+                    self.assertEqual(fp.read(), source)
+                self.assertEqual(os.stat(filename).st_mode & 0o777, 0o640)
+
+            # A file which doesn't need to be patched is left unchanged
+            os.unlink(filename + ".old")
+            exitcode, stderr = self.run_main('--chunk-size', '100', filename)
+            self.assertEqual(exitcode, 0)
+            self.assertEqual(sorted(os.listdir(tmp_dir)), ["mod.c"])
+            with open(filename, encoding="utf-8") as fp:
+                self.assertEqual(fp.read(), expected)
+
+    def test_chunk_size_empty_lines(self):
+        # Regexes can match empty lines before "=" and ";", and in
+        # subscripts: the file must be patched as a whole file.
+        func = textwrap.dedent("""
+            static PyObject* func{index}(PyObject *obj, PyObject *value)
+            {{
+                obj->ob_type
+
+                    = type;
+                Py_INCREF(value)
+
+                ;return value;
+                return array[
+
+                    {index}]->ob_type;
+            }}
+        """)
+        source = ''.join(func.format(index=index) for index in range(20))
+        args = ['-B', '-o', 'all,Py_NewRef']
+        expected = upgrade_pythoncapi.Patcher(args + ['mod.c']).patch(source)
+        self.assertNotEqual(expected, source)
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            filename = os.path.join(tmp_dir, "mod.c")
+            for chunk_size in (1, 10, 100):
+                with open(filename, "w", encoding="utf-8") as fp:
+                    fp.write(source)
+                exitcode, stderr = self.run_main(*args, '--chunk-size',
+                                                 str(chunk_size), filename)
+                self.assertEqual(exitcode, 0)
+                with open(filename, encoding="utf-8") as fp:
+                    self.assertEqual(fp.read(), expected)
+
+    def test_chunk_size_window_extension(self):
+        # A window ending inside a C comment or inside a subscript is
+        # extended, but only up to a limit: an unbalanced "[" or a long
+        # comment must not load the whole file.
+        func = textwrap.dedent("""
+            static PyTypeObject* func{index}(PyObject *obj)
+            {{
+                return obj->ob_type;
+            }}
+        """)
+        funcs = ''.join(func.format(index=index) for index in range(2000))
+        chunk_size = 100
+        for prefix, suffix in (
+            ('#define OPEN [\n', ''),
+            ('/*\n', '*/\n'),
+        ):
+            with self.subTest(prefix=prefix):
+                source = prefix + funcs + suffix + func.format(index='')
+                self.assertGreater(len(source),
+                                   upgrade_pythoncapi.WINDOW_MIN_EXTENSION * 2)
+                expected = upgrade_pythoncapi.Patcher(['mod.c']).patch(source)
+                self.assertNotEqual(expected, source)
+
+                patcher = upgrade_pythoncapi.Patcher(
+                    ['--chunk-size', str(chunk_size), 'mod.c'])
+                with mock.patch.object(patcher, 'log') as log:
+                    windows = list(patcher._iter_windows(source.encode(),
+                                                         'mod.c'))
+                log.assert_called_once_with(
+                    "WARNING: mod.c: cut a window inside a comment "
+                    "or a subscript")
+                self.assertEqual(''.join(text for text, patch in windows),
+                                 source)
+                max_size = upgrade_pythoncapi.WINDOW_MIN_EXTENSION * 2
+                for text, patch in windows:
+                    self.assertLess(len(text), max_size)
+
+                with tempfile.TemporaryDirectory() as tmp_dir:
+                    filename = os.path.join(tmp_dir, "mod.c")
+                    with open(filename, "w", encoding="utf-8") as fp:
+                        fp.write(source)
+                    exitcode, stderr = self.run_main('--chunk-size',
+                                                     str(chunk_size), filename)
+                    self.assertEqual(exitcode, 0)
+                    with open(filename, encoding="utf-8") as fp:
+                        self.assertEqual(fp.read(), expected)
+
+    def test_atomic_write(self):
+        source = "int x = obj->ob_size;\n"
+        expected = "int x = Py_SIZE(obj);\n"
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            filenames = []
+            for index in range(3):
+                filename = os.path.join(tmp_dir, f"mod{index}.c")
+                with open(filename, "w", encoding="utf-8") as fp:
+                    fp.write(source)
+                os.chmod(filename, 0o640)
+                filenames.append(filename)
+            filename = filenames[0]
+
+            # Interrupted write: the file is left unchanged
+            with mock.patch('os.replace', side_effect=KeyboardInterrupt):
+                with self.assertRaises(KeyboardInterrupt):
+                    self.run_main('-B', '-o', 'Py_SIZE', filename)
+            self.assertEqual(sorted(os.listdir(tmp_dir)),
+                             ["mod0.c", "mod1.c", "mod2.c"])
+            with open(filename, encoding="utf-8") as fp:
+                self.assertEqual(fp.read(), source)
+
+            # --fsync flushes each file, and the directory once
+            with mock.patch('os.fsync', wraps=os.fsync) as fsync:
+                exitcode, stderr = self.run_main('--fsync', '-o', 'Py_SIZE',
+                                                 *filenames)
+            self.assertEqual(exitcode, 0)
+            self.assertEqual(fsync.call_count, 4)
+            for filename in filenames:
+                with open(filename, encoding="utf-8") as fp:
+                    self.assertEqual(fp.read(), expected)
+                with open(filename + ".old", encoding="utf-8") as fp:
+                    self.assertEqual(fp.read(), source)
+                self.assertEqual(os.stat(filename).st_mode & 0o777, 0o640)
+            self.assertEqual(len(os.listdir(tmp_dir)), 6)
+
+    @unittest.skipUnless(hasattr(os, 'symlink'), 'need os.symlink()')
+    def test_symlink(self):
+        source = "int x = obj->ob_size;\n"
+        expected = "int x = Py_SIZE(obj);\n"
+
+        for args in (('-B',), (), ('-B', '--chunk-size', '1')):
+            with tempfile.TemporaryDirectory() as tmp_dir:
+                target = os.path.join(tmp_dir, "target.c")
+                with open(target, "w", encoding="utf-8") as fp:
+                    fp.write(source)
+                link = os.path.join(tmp_dir, "link.c")
+                os.symlink("target.c", link)
+
+                exitcode, stderr = self.run_main(*args, '-o', 'Py_SIZE', link)
+                self.assertEqual(exitcode, 0)
+
+                # The target is patched, the link is left unchanged
+                self.assertTrue(os.path.islink(link))
+                with open(target, encoding="utf-8") as fp:
+                    self.assertEqual(fp.read(), expected)
+                if '-B' in args:
+                    self.assertEqual(sorted(os.listdir(tmp_dir)),
+                                     ["link.c", "target.c"])
+                else:
+                    with open(target + ".old", encoding="utf-8") as fp:
+                        self.assertEqual(fp.read(), source)
+
+    @unittest.skipUnless(hasattr(os, 'link'), 'need os.link()')
+    def test_hard_link(self):
+        source = "int x = obj->ob_size;\n"
+        expected = "int x = Py_SIZE(obj);\n"
+
+        for args in (('-B',), ()):
+            with tempfile.TemporaryDirectory() as tmp_dir:
+                filename = os.path.join(tmp_dir, "mod.c")
+                with open(filename, "w", encoding="utf-8") as fp:
+                    fp.write(source)
+                link = os.path.join(tmp_dir, "link.c")
+                os.link(filename, link)
+
+                exitcode, stderr = self.run_main(*args, '-o', 'Py_SIZE',
+                                                 filename)
+                self.assertEqual(exitcode, 0)
+
+                # The file is written in place: the hard link is kept
+                self.assertTrue(os.path.samefile(filename, link))
+                with open(link, encoding="utf-8") as fp:
+                    self.assertEqual(fp.read(), expected)
+                if not args:
+                    with open(filename + ".old", encoding="utf-8") as fp:
+                        self.assertEqual(fp.read(), source)
+
+    def test_stats(self):
+        source = reformat("""
+            /* obj->ob_type */
+            PyObject* func(PyObject *obj, PyTypeObject *type)
+            {
+                Py_TYPE(obj) = type;
+                Py_ssize_t size = obj->ob_size + obj->ob_size;
+                if (obj == Py_None) {
+                    return NULL;
+                }
+                Py_INCREF(obj);
+                return obj;
+            }
+        """)
+        unchanged = "int x;\n"
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            filename = os.path.join(tmp_dir, "mod.c")
+            with open(filename, "w", encoding="utf-8") as fp:
+                fp.write(source)
+            filename2 = os.path.join(tmp_dir, "unchanged.c")
+            with open(filename2, "w", encoding="utf-8") as fp:
+                fp.write(unchanged)
+
+            for args in ((), ('-j', '2'), ('--chunk-size', '10')):
+                with mock.patch('sys.stdout', new_callable=io.StringIO) as stdout:
+                    exitcode, stderr = self.run_main(
+                        '--stats', '-o', 'all,Py_NewRef,-Py_REFCNT',
+                        *args, filename, filename2)
+                self.assertEqual(exitcode, 0)
+                self.assertEqual(stderr, "")
+                report = json.loads(stdout.getvalue())
+                self.assertEqual(report["scanned_files"], 2)
+                self.assertEqual(report["files"], {
+                    filename: {"Py_SET_TYPE": 1, "Py_SIZE": 2, "Py_Is": 1,
+                               "Py_NewRef": 1},
+                })
+                operations = report["operations"]
+                self.assertEqual(operations["Py_SIZE"], 2)
+                self.assertEqual(operations["PyMem_MALLOC"], 0)
+                self.assertNotIn("Py_REFCNT", operations)
+
+            # Files are not modified
+            self.assertEqual(sorted(os.listdir(tmp_dir)),
+                             ["mod.c", "unchanged.c"])
+            with open(filename, encoding="utf-8") as fp:
+                self.assertEqual(fp.read(), source)
+
+    def test_stats_chained(self):
+        # Py_SETREF applies to the output of Py_NewRef
+        source = reformat("""
+            void set_attr(MyObject *self, PyObject *value)
+            {
+                Py_DECREF(self->attr);
+                Py_INCREF(value);
+                self->attr = value;
+            }
+        """)
+        args = ('-B', '-o', 'all,Py_NewRef,Py_SETREF')
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            filename = os.path.join(tmp_dir, "mod.c")
+            with open(filename, "w", encoding="utf-8") as fp:
+                fp.write(source)
+
+            with mock.patch('sys.stdout', new_callable=io.StringIO) as stdout:
+                exitcode, stderr = self.run_main('--stats', *args, filename)
+            self.assertEqual(exitcode, 0)
+            report = json.loads(stdout.getvalue())
+            self.assertEqual(report["files"],
+                             {filename: {"Py_NewRef": 1, "Py_SETREF": 1}})
+
+            # Same operations than when the file is patched
+            exitcode, stderr = self.run_main(*args, filename)
+            self.assertEqual(exitcode, 0)
+            self.assertIn(f"Patched file: {filename} (Py_NewRef, Py_SETREF)",
+                          stderr.splitlines())
+            with open(filename, encoding="utf-8") as fp:
+                self.assertIn("Py_SETREF(self->attr, Py_NewRef(value));",
+                              fp.read())
+
+    def test_comments_and_strings(self):
+        # Don't patch comments and string literals
+        self.check_dont_replace("""
+            /* obj->ob_type == Py_None */
+            // Py_XDECREF(x); x = NULL;
+            puts("obj->ob_type");
+            puts("escaped \\" obj->ob_refcnt");
+            char c = '"'; /* obj->ob_size
+               frame->f_back */
+        """)
+
+        self.check_replace("""
+            // Get the type
+            PyTypeObject *type = obj->ob_type;  /* obj->ob_type */
+            printf("%s == Py_None", name);
+            if (obj == Py_None) { puts("ob_type"); }
+        """, """
+            // Get the type
+            PyTypeObject *type = Py_TYPE(obj);  /* obj->ob_type */
+            printf("%s == Py_None", name);
+            if (Py_IsNone(obj)) { puts("ob_type"); }
+        """, no_compat=True)
+
+        self.assertEqual(upgrade_pythoncapi.mask_literals('a "b" /* c */'),
+                         ('a \x000\x00 \x001\x00', ['"b"', '/* c */']))
+
+    def test_prefilter(self):
+        for operation in upgrade_pythoncapi.OPERATIONS:
+            self.assertTrue(operation.TOKENS, operation.NAME)
+
+        patcher = upgrade_pythoncapi.Patcher(['-o', operations(), 'mod.c'])
+        self.assertEqual(patcher._find_tokens("int x = 1;"), set())
+        # "Py_XDECREF" contains "DECREF"
+        self.assertEqual(patcher._find_tokens("Py_XDECREF(x); x = y;"),
+                         {"Py_XDECREF", "DECREF"})
+        self.assertEqual(patcher._find_tokens("Py_INCREF(x); Py_DECREF(y);"),
+                         {"INCREF", "DECREF"})
+
+        # Operations are skipped if their tokens are missing
+        self.check_dont_replace("""
+            Py_ssize_t size = obj->ob_type_size;
+            int var = frame_count;
+        """)
+        self.check_replace("""
+            Py_XDECREF(x);
+            x = y;
+        """, """
+            Py_XSETREF(x, y);
+        """, no_compat=True)
+
     def check_replace(self, source, expected, **kwargs):
         source = reformat(source)
         expected = reformat(expected)
@@ -248,6 +886,12 @@ class Tests(unittest.TestCase):
             }
         """)
 
+        # Cast and multiple assignments on the same line
+        self.check_replace("Py_TYPE((PyObject *)obj) = type; Py_TYPE(a) = b;",
+                           "Py_SET_TYPE((PyObject *)obj, type); "
+                           "Py_SET_TYPE(a, b);",
+                           no_compat=True)
+
     def test_py_set_size(self):
         source = """\
             void test_size(PyVarObject *obj)
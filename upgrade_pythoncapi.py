@@ -1,7 +1,17 @@
 #!/usr/bin/env python3
 import argparse
+import contextlib
+import hashlib
+import json
+import mmap
+import multiprocessing
 import os
 import re
+import signal
+import shutil
+import subprocess
+import tempfile
+import threading
 import urllib.request
 import sys
 
@@ -23,6 +33,18 @@ C_FILE_EXT = (
 )
 IGNORE_DIRS = (".git", ".tox")
 
+# Format version of the --cache file
+CACHE_VERSION = 1
+
+# Files larger than --chunk-size bytes are memory-mapped and patched
+# window by window
+DEFAULT_CHUNK_SIZE = 8 * 1024 * 1024
+# A window ending inside a C comment or inside a subscript is extended by
+# up to WINDOW_MAX_EXTENSION chunks, and at least WINDOW_MIN_EXTENSION bytes:
+# see Patcher._iter_windows()
+WINDOW_MAX_EXTENSION = 4
+WINDOW_MIN_EXTENSION = 64 * 1024
+
 
 # Match spaces but not newline characters.
 # Similar to \s but exclude newline characters and only look for ASCII spaces
@@ -37,10 +59,15 @@ INDENTATION_REGEX = fr'^{SPACE_REGEX}*'
 # Use \b to only match a full word: match "a_b", but not just "b" in "a_b".
 ID_REGEX = r'\b[a-zA-Z_][a-zA-Z0-9_]*\b'
 # Match 'array[3]'
-SUBEXPR_REGEX = fr'{ID_REGEX}(?:\[[^]]+\])*'
+# The subscript cannot contain brackets, so that a scan stops at the next
+# bracket and the regex runs in linear time.
+SUBEXPR_REGEX = fr'{ID_REGEX}(?:\[[^][]+\])*'
 # Match a C expression like "frame", "frame.attr", "obj->attr" or "*obj".
 # Don't match functions calls like "func()".
-EXPR_REGEX = (fr"\*?"  # "*" prefix
+# Don't start in the middle of "a->b.c": otherwise, the regex would be
+# tried at each attribute of long chains, which takes quadratic time.
+EXPR_REGEX = (fr"(?<!->)(?<!\.)"
+              fr"\*?"  # "*" prefix
               fr"{SUBEXPR_REGEX}"  # "var"
               fr"(?:(?:->|\.){SUBEXPR_REGEX})*")  # "->attr" or ".attr"
 
@@ -83,11 +110,18 @@ def set_member_regex(member):
     return re.compile(regex)
 
 
+# Match a function call argument: "obj" or "(PyObject*)obj". Parentheses
+# can only be nested once, so that the scan stops at the closing parenthesis
+# and the regex runs in linear time.
+CALL_ARG_REGEX = r'[^()\n]*(?:\([^()\n]*\)[^()\n]*)*'
+
+
 def call_assign_regex(name):
     # Match "Py_TYPE(expr) = expr;".
     # Don't match "assert(Py_TYPE(expr) == expr);".
     # Tolerate spaces
-    regex = fr'{name} *\( *(.+) *\) *= *([^=].*) *;'
+    # The value stops at the first ";".
+    regex = fr'{name} *\( *({CALL_ARG_REGEX}) *\) *= *([^=;][^;\n]*?) *;'
     return re.compile(regex)
 
 
@@ -95,10 +129,53 @@ def is_c_filename(filename):
     return filename.endswith(C_FILE_EXT)
 
 
+class FileTimeout(Exception):
+    pass
+
+
+# Match comments, string literals and character literals
+LITERAL_REGEX = re.compile(
+    r'//[^\r\n]*'                 # C++ comment
+    r'|/\*.*?\*/'                  # C comment
+    r'|"(?:[^"\\\r\n]|\\.)*"'      # string literal
+    r"|'(?:[^'\\\r\n]|\\.)*'",     # character literal
+    re.DOTALL)
+# Placeholder of a masked literal: "\0index\0". Operation regexes never
+# match a placeholder, nor a part of it.
+PLACEHOLDER = '\0'
+PLACEHOLDER_REGEX = re.compile('\0([0-9]+)\0')
+
+
+def mask_literals(content):
+    # Replace comments and string literals with placeholders, so that
+    # operations don't patch them. Return (content, literals).
+    if PLACEHOLDER in content:
+        # Binary content: don't mask
+        return (content, None)
+
+    literals = []
+
+    def replace(regs):
+        literals.append(regs.group(0))
+        return f'{PLACEHOLDER}{len(literals) - 1}{PLACEHOLDER}'
+
+    return (LITERAL_REGEX.sub(replace, content), literals)
+
+
+def unmask_literals(content, literals):
+    if not literals:
+        return content
+    return PLACEHOLDER_REGEX.sub(lambda regs: literals[int(regs.group(1))],
+                                 content)
+
+
 class Operation:
     NAME = "<name>"
     REPLACE = ()
     NEED_PYTHONCAPI_COMPAT = False
+    # Strings which must be present in the content for REPLACE to match.
+    # If empty, the operation is always run.
+    TOKENS = ()
 
     def __init__(self, patcher):
         self.patcher = patcher
@@ -111,9 +188,20 @@ class Operation:
             content = self.patcher.add_pythoncapi_compat(content)
         return content
 
+    def count(self, content):
+        # Count replacements. Return (count, content): the content is patched,
+        # so that the next operations count replacements of the patched
+        # content, as patch() does. The include is not added.
+        total = 0
+        for regex, replace in self.REPLACE:
+            content, count = regex.subn(replace, content)
+            total += count
+        return (total, content)
+
 
 class Py_TYPE(Operation):
     NAME = "Py_TYPE"
+    TOKENS = ('ob_type',)
     REPLACE = (
         (get_member_regex('ob_type'), r'Py_TYPE(\1)'),
     )
@@ -122,6 +210,7 @@ class Py_TYPE(Operation):
 
 class Py_SIZE(Operation):
     NAME = "Py_SIZE"
+    TOKENS = ('ob_size',)
     REPLACE = (
         (get_member_regex('ob_size'), r'Py_SIZE(\1)'),
     )
@@ -130,6 +219,7 @@ class Py_SIZE(Operation):
 
 class Py_REFCNT(Operation):
     NAME = "Py_REFCNT"
+    TOKENS = ('ob_refcnt',)
     REPLACE = (
         (get_member_regex('ob_refcnt'), r'Py_REFCNT(\1)'),
     )
@@ -138,6 +228,7 @@ class Py_REFCNT(Operation):
 
 class Py_SET_TYPE(Operation):
     NAME = "Py_SET_TYPE"
+    TOKENS = ('Py_TYPE', 'ob_type')
     REPLACE = (
         (call_assign_regex('Py_TYPE'), r'Py_SET_TYPE(\1, \2);'),
         (set_member_regex('ob_type'), r'Py_SET_TYPE(\1, \2);'),
@@ -148,6 +239,7 @@ class Py_SET_TYPE(Operation):
 
 class Py_SET_SIZE(Operation):
     NAME = "Py_SET_SIZE"
+    TOKENS = ('Py_SIZE', 'ob_size')
     REPLACE = (
         (call_assign_regex('Py_SIZE'), r'Py_SET_SIZE(\1, \2);'),
         (set_member_regex('ob_size'), r'Py_SET_SIZE(\1, \2);'),
@@ -158,6 +250,7 @@ class Py_SET_SIZE(Operation):
 
 class Py_SET_REFCNT(Operation):
     NAME = "Py_SET_REFCNT"
+    TOKENS = ('Py_REFCNT', 'ob_refcnt')
     REPLACE = (
         (call_assign_regex('Py_REFCNT'), r'Py_SET_REFCNT(\1, \2);'),
         (set_member_regex('ob_refcnt'), r'Py_SET_REFCNT(\1, \2);'),
@@ -168,6 +261,7 @@ class Py_SET_REFCNT(Operation):
 
 class PyObject_NEW(Operation):
     NAME = "PyObject_NEW"
+    TOKENS = ('PyObject_NEW',)
     # In Python 3.9, the PyObject_NEW() macro becomes an alias to the
     # PyObject_New() macro, and the PyObject_NEW_VAR() macro becomes an alias
     # to the PyObject_NewVar() macro.
@@ -179,6 +273,7 @@ class PyObject_NEW(Operation):
 
 class PyMem_MALLOC(Operation):
     NAME = "PyMem_MALLOC"
+    TOKENS = ('PyMem_',)
     # In Python 3.9, the PyObject_NEW() macro becomes an alias to the
     # PyObject_New() macro, and the PyObject_NEW_VAR() macro becomes an alias
     # to the PyObject_NewVar() macro.
@@ -194,6 +289,8 @@ class PyMem_MALLOC(Operation):
 
 class PyObject_MALLOC(Operation):
     NAME = "PyObject_MALLOC"
+    TOKENS = ('PyObject_MALLOC', 'PyObject_REALLOC', 'PyObject_FREE',
+              'PyObject_Del', 'PyObject_DEL')
     # In Python 3.9, the PyObject_NEW() macro becomes an alias to the
     # PyObject_New() macro, and the PyObject_NEW_VAR() macro becomes an alias
     # to the PyObject_NewVar() macro.
@@ -209,6 +306,7 @@ class PyObject_MALLOC(Operation):
 
 class PyFrame_GetBack(Operation):
     NAME = "PyFrame_GetBack"
+    TOKENS = ('f_back',)
     REPLACE = (
         (get_member_regex('f_back'), r'_PyFrame_GetBackBorrow(\1)'),
     )
@@ -218,6 +316,7 @@ class PyFrame_GetBack(Operation):
 
 class PyFrame_GetCode(Operation):
     NAME = "PyFrame_GetCode"
+    TOKENS = ('f_code',)
 
     REPLACE = (
         (get_member_regex('f_code'), r'_PyFrame_GetCodeBorrow(\1)'),
@@ -228,6 +327,7 @@ class PyFrame_GetCode(Operation):
 
 class PyThreadState_GetInterpreter(Operation):
     NAME = "PyThreadState_GetInterpreter"
+    TOKENS = ('interp',)
     REPLACE = (
         (get_member_regex('interp'), r'PyThreadState_GetInterpreter(\1)'),
     )
@@ -237,6 +337,7 @@ class PyThreadState_GetInterpreter(Operation):
 
 class PyThreadState_GetFrame(Operation):
     NAME = "PyThreadState_GetFrame"
+    TOKENS = ('frame',)
     REPLACE = (
         (get_member_regex('frame'), r'_PyThreadState_GetFrameBorrow(\1)'),
     )
@@ -247,6 +348,7 @@ class PyThreadState_GetFrame(Operation):
 
 class Py_NewRef(Operation):
     NAME = "Py_NewRef"
+    TOKENS = ('INCREF',)
     REPLACE = (
         # "Py_INCREF(x); return x;" => "return Py_NewRef(x);"
         # "Py_XINCREF(x); return x;" => "return Py_XNewRef(x);"
@@ -346,6 +448,7 @@ class Py_NewRef(Operation):
 
 class Py_CLEAR(Operation):
     NAME = "Py_CLEAR"
+    TOKENS = ('Py_XDECREF',)
     REPLACE = (
         # "Py_XDECREF(x); x = NULL;" => "Py_CLEAR(x)";
         # The two statements must have the same indentation, otherwise the
@@ -370,6 +473,7 @@ SETREF_VALUE = fr'{OPT_CAST_REGEX}(?:{EXPR_REGEX}|Py_X?NewRef\({EXPR_REGEX}\))'
 
 class Py_SETREF(Operation):
     NAME = "Py_SETREF"
+    TOKENS = ('Py_CLEAR', 'DECREF')
     REPLACE = (
         # "Py_INCREF(y); Py_CLEAR(x); x = y;" => "Py_XSETREF(x, y)";
         # Statements must have the same indentation, otherwise the regex does
@@ -438,23 +542,20 @@ class Py_SETREF(Operation):
 
 class Py_Is(Operation):
     NAME = "Py_Is"
+    TOKENS = ('Py_None', 'Py_True', 'Py_False')
 
-    def replace2(regs):
-        x = regs.group(1)
-        y = regs.group(2)
-        if y == 'NULL':
-            return regs.group(0)
-        return f'{x} = _Py_StealRef({y});'
-
-    REPLACE = []
-    expr = fr'({EXPR_REGEX})'
-    for name in ('None', 'True', 'False'):
-        REPLACE.extend((
-            (re.compile(fr'{expr} == Py_{name}\b'),
-             fr'Py_Is{name}(\1)'),
-            (re.compile(fr'{expr} != Py_{name}\b'),
-             fr'!Py_Is{name}(\1)'),
-        ))
+    def replace(regs):
+        # "x == Py_None" => "Py_IsNone(x)"
+        # "x != Py_None" => "!Py_IsNone(x)"
+        expr, op, name = regs.groups()
+        neg = '!' if op == '!=' else ''
+        return f'{neg}Py_Is{name}({expr})'
+
+    # Single regex for the 6 cases to scan the content only once
+    REPLACE = (
+        (re.compile(fr'({EXPR_REGEX}) (==|!=) Py_(None|True|False)\b'),
+         replace),
+    )
 
     # Need Py_IsNone(), Py_IsTrue(), Py_IsFalse(): new in Python 3.10
     NEED_PYTHONCAPI_COMPAT = (MIN_PYTHON < (3, 10))
@@ -511,9 +612,35 @@ class Patcher:
         self._has_pythoncapi_compat = None
         self._applied_operations = None
 
+        # Set by _patch_large_file(): add_pythoncapi_compat() only records
+        # that the include is needed, it's added once at the end
+        self._defer_pythoncapi_compat = False
+        self._pythoncapi_compat_needed = False
+
+        # Set by worker processes to log messages in the parent process
+        self._log_messages = None
+
+        # Set by _compile_prefilter()
+        self._prefilter = None
+        self._prefilter_tokens = None
+
+        # --cache: hashes of file contents which don't need to be patched,
+        # loaded by _load_cache(), and hashes of such files seen by this run
+        self._cache_clean = None
+        self._cache_seen = set()
+
+        # --fsync: directories of renamed files, flushed by sync_dirs()
+        self._fsync_dirs = set()
+
+        if args is None:
+            args = sys.argv[1:]
+        self._argv = args
         self._parse_options(args)
 
     def log(self, msg=''):
+        if self._log_messages is not None:
+            self._log_messages.append(msg)
+            return
         print(msg, file=sys.stderr, flush=True)
 
     def warning(self, msg):
@@ -553,11 +680,14 @@ class Patcher:
 
         return operations
 
-    def add_line(self, content, line):
+    @staticmethod
+    def _get_newline(content):
         # Use the first matching newline
         match = re.search(r'(?:\r\n|\n|\r)', content)
-        newline = match.group(0) if match else '\n'
+        return match.group(0) if match else '\n'
 
+    def add_line(self, content, line):
+        newline = self._get_newline(content)
         line = line + newline
         # FIXME: tolerate trailing spaces
         if line not in content:
@@ -571,23 +701,69 @@ class Patcher:
     def add_pythoncapi_compat(self, content):
         if self._has_pythoncapi_compat:
             return content
+        if self._defer_pythoncapi_compat:
+            self._pythoncapi_compat_needed = True
+            return content
         content = self.add_line(content, INCLUDE_PYTHONCAPI_COMPAT)
         self._has_pythoncapi_compat = True
         self.pythoncapi_compat_added += 1
         return content
 
-    def _patch(self, content):
+    def _compile_prefilter(self):
+        # Compile a regex matching the tokens of all selected operations,
+        # to find them in a single scan of the content.
+        tokens = set()
+        for operation in self.operations:
+            tokens.update(operation.TOKENS)
+        if not tokens:
+            self._prefilter = None
+            return
+
+        # Try longest tokens first. A match of a token also means that the
+        # tokens it contains are present: "Py_XDECREF" contains "DECREF".
+        tokens = sorted(tokens, key=lambda token: (-len(token), token))
+        regex = '|'.join(re.escape(token) for token in tokens)
+        self._prefilter = re.compile(regex)
+        self._prefilter_tokens = {
+            token: frozenset(other for other in tokens if other in token)
+            for token in tokens}
+
+    def _find_tokens(self, content):
+        if self._prefilter is None:
+            return frozenset()
+        found = set()
+        for match in self._prefilter.finditer(content):
+            token = match.group(0)
+            if token not in found:
+                found |= self._prefilter_tokens[token]
+        return found
+
+    def _patch(self, content, has_pythoncapi_compat=None):
         try:
-            has = (self.args.no_compat
-                   or INCLUDE_PYTHONCAPI_COMPAT in content
-                   or INCLUDE_PYTHONCAPI_COMPAT2 in content)
+            has = has_pythoncapi_compat
+            if has is None:
+                has = (self.args.no_compat
+                       or INCLUDE_PYTHONCAPI_COMPAT in content
+                       or INCLUDE_PYTHONCAPI_COMPAT2 in content)
             self._has_pythoncapi_compat = has
             self._applied_operations = []
+            tokens = self._find_tokens(content)
+            literals = None
+            if tokens or not all(op.TOKENS for op in self.operations):
+                content, literals = mask_literals(content)
+                # Ignore tokens of comments and string literals
+                tokens = self._find_tokens(content)
             for operation in self.operations:
+                if operation.TOKENS and tokens.isdisjoint(operation.TOKENS):
+                    # Skip the operation: none of its regexes can match
+                    continue
                 new_content = operation.patch(content)
                 if new_content != content:
                     self._applied_operations.append(operation.NAME)
+                    # The operation can add tokens used by next operations
+                    tokens = self._find_tokens(new_content)
                 content = new_content
+            content = unmask_literals(content, literals)
             applied_operations = self._applied_operations
         finally:
             self._has_pythoncapi_compat = None
@@ -597,18 +773,103 @@ class Patcher:
     def patch(self, content):
         return self._patch(content)[0]
 
+    def count(self, content):
+        # Return {operation name: number of matches}
+        counts = {}
+        tokens = self._find_tokens(content)
+        if tokens or not all(op.TOKENS for op in self.operations):
+            content = mask_literals(content)[0]
+            tokens = self._find_tokens(content)
+        for operation in self.operations:
+            if operation.TOKENS and tokens.isdisjoint(operation.TOKENS):
+                continue
+            count, content = operation.count(content)
+            if count:
+                counts[operation.NAME] = counts.get(operation.NAME, 0) + count
+                # The operation can add tokens used by next operations
+                tokens = self._find_tokens(content)
+        return counts
+
+    def count_file(self, filename):
+        # --stats: return {operation name: number of matches},
+        # or None if the file is skipped
+        if os.path.basename(filename) == PYTHONCAPI_COMPAT_H:
+            return None
+
+        chunk_size = self.args.chunk_size
+        counts = {}
+        with open(filename, "rb") as fp:
+            if chunk_size and os.fstat(fp.fileno()).st_size > chunk_size:
+                data = mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ)
+            else:
+                data = fp.read()
+            try:
+                if self._cache_clean is not None:
+                    if hashlib.sha256(data).hexdigest() in self._cache_clean:
+                        # The file doesn't need to be patched
+                        return counts
+
+                with self._time_budget():
+                    if chunk_size and len(data) > chunk_size:
+                        windows = self._iter_windows(data, filename)
+                    else:
+                        windows = ((data.decode("utf-8", "surrogateescape"),
+                                    True),)
+                    for window, patch in windows:
+                        if not patch:
+                            continue
+                        for name, count in self.count(window).items():
+                            counts[name] = counts.get(name, 0) + count
+            except FileTimeout:
+                self._timeout_warning(filename)
+                return None
+            finally:
+                if isinstance(data, mmap.mmap):
+                    data.close()
+        return counts
+
     def patch_file(self, filename):
         if os.path.basename(filename) == PYTHONCAPI_COMPAT_H:
             self.log(f"Skip {filename}")
             return
 
+        chunk_size = self.args.chunk_size
+        if (chunk_size and not self.args.to_stdout
+                and os.path.getsize(filename) > chunk_size):
+            return self._patch_large_file(filename)
+
         encoding = "utf-8"
         errors = "surrogateescape"
 
-        with open(filename, encoding=encoding, errors=errors, newline="") as fp:
-            old_contents = fp.read()
-
-        new_contents, operations = self._patch(old_contents)
+        with open(filename, "rb") as fp:
+            data = fp.read()
+        old_contents = data.decode(encoding, errors)
+
+        content_hash = None
+        if self._cache_clean is not None:
+            content_hash = hashlib.sha256(data).hexdigest()
+            if content_hash in self._cache_clean:
+                # The file is known to not need to be patched
+                self._cache_seen.add(content_hash)
+                if self.args.to_stdout:
+                    print(old_contents, end="")
+                return False
+
+        compat_added = self.pythoncapi_compat_added
+        try:
+            with self._time_budget():
+                new_contents, operations = self._patch(old_contents)
+                if content_hash is not None:
+                    if new_contents == old_contents:
+                        self._cache_seen.add(content_hash)
+                    elif self._patch(new_contents)[0] == new_contents:
+                        # The next run will not have to patch the patched file
+                        data = new_contents.encode(encoding, errors)
+                        self._cache_seen.add(hashlib.sha256(data).hexdigest())
+        except FileTimeout:
+            self.pythoncapi_compat_added = compat_added
+            self._timeout_warning(filename)
+            return False
 
         if self.args.to_stdout:
             print(new_contents, end="")
@@ -619,19 +880,362 @@ class Patcher:
         if new_contents == old_contents:
             return False
 
+        self._write_file(filename, new_contents.encode(encoding, errors))
+
+        self.applied_operations |= set(operations)
+        operations = ', '.join(operations)
+        self.log(f"Patched file: {filename} ({operations})")
+        return True
+
+    @staticmethod
+    def _create_temp_file(filename):
+        # Create a temporary file in the directory of filename, so that it
+        # can be renamed to filename. Return (fd, tmp_filename).
+        # filename must be resolved by os.path.realpath().
+        dirname = os.path.dirname(filename) or os.curdir
+        prefix = os.path.basename(filename) + "."
+        return tempfile.mkstemp(dir=dirname, prefix=prefix, suffix=".tmp")
+
+    def _write_file(self, filename, data):
+        # Write data into a temporary file and rename it to filename: if the
+        # process is interrupted, filename is left unchanged.
+        # Replace the target of a symbolic link, not the link.
+        filename = os.path.realpath(filename)
+        fd, tmp_filename = self._create_temp_file(filename)
+        try:
+            with open(fd, "wb") as fp:
+                fp.write(data)
+            self._replace_file(filename, tmp_filename)
+        except BaseException:
+            with contextlib.suppress(FileNotFoundError):
+                os.unlink(tmp_filename)
+            raise
+
+    def _replace_file(self, filename, tmp_filename):
+        # Replace filename with tmp_filename.
+        # filename must be resolved by os.path.realpath().
+        st = os.stat(filename)
+        if st.st_nlink > 1:
+            self._copy_file_inplace(tmp_filename, filename)
+            return
+
+        self._copy_metadata(st, filename, tmp_filename)
+        if self.args.fsync:
+            # Write the data on disk before the rename. Directories are
+            # only flushed once by sync_dirs().
+            with open(tmp_filename, "rb+") as fp:
+                os.fsync(fp.fileno())
+            self._fsync_dirs.add(os.path.dirname(filename))
         if not self.args.no_backup:
-            old_filename = filename + ".old"
-            # If old_filename already exists, replace it
-            os.replace(filename, old_filename)
+            self._backup(filename)
+        os.replace(tmp_filename, filename)
 
-        with open(filename, "w", encoding=encoding, errors=errors, newline="") as fp:
-            fp.write(new_contents)
+    def _copy_file_inplace(self, tmp_filename, filename):
+        # A rename would split hard links: write the file in place instead.
+        # The write is not atomic.
+        if not self.args.no_backup:
+            shutil.copy2(filename, filename + ".old")
+        with open(tmp_filename, "rb") as src:
+            with open(filename, "r+b") as dst:
+                shutil.copyfileobj(src, dst)
+                dst.truncate()
+                if self.args.fsync:
+                    dst.flush()
+                    os.fsync(dst.fileno())
+        os.unlink(tmp_filename)
+
+    @staticmethod
+    def _copy_metadata(st, filename, tmp_filename):
+        # Copy the mode, the owner and the extended attributes of filename,
+        # but not its modification time
+        shutil.copymode(filename, tmp_filename)
+        if hasattr(os, 'chown'):
+            tmp_st = os.stat(tmp_filename)
+            if (tmp_st.st_uid, tmp_st.st_gid) != (st.st_uid, st.st_gid):
+                try:
+                    os.chown(tmp_filename, st.st_uid, st.st_gid)
+                except OSError:
+                    # Only root can change the owner
+                    pass
+        if hasattr(os, 'listxattr'):
+            try:
+                names = os.listxattr(filename)
+            except OSError:
+                names = ()
+            for name in names:
+                try:
+                    os.setxattr(tmp_filename, name, os.getxattr(filename, name))
+                except OSError:
+                    pass
+
+    @staticmethod
+    def _backup(filename):
+        # Create filename.old. The file is linked rather than renamed, so
+        # that filename always exists. The link is only safe if filename is
+        # then replaced, not modified in place.
+        old_filename = filename + ".old"
+        # If old_filename already exists, replace it
+        with contextlib.suppress(FileNotFoundError):
+            os.unlink(old_filename)
+        try:
+            os.link(filename, old_filename)
+        except OSError:
+            # Hard links are not supported
+            shutil.copy2(filename, old_filename)
+
+    def sync_dirs(self):
+        # --fsync: flush renames of patched files on disk, once per directory
+        for dirname in sorted(self._fsync_dirs):
+            try:
+                fd = os.open(dirname, os.O_RDONLY)
+            except OSError:
+                # Opening a directory is not supported on Windows
+                continue
+            try:
+                os.fsync(fd)
+            except OSError:
+                pass
+            finally:
+                os.close(fd)
+        self._fsync_dirs.clear()
+
+    def _timeout_warning(self, filename):
+        self.warning(f"Skip {filename}: patching took longer than "
+                     f"{self.args.timeout} seconds")
+        self.exitcode = 1
+
+    def _iter_windows(self, data, filename):
+        # Split data (bytes or mmap) into windows of about --chunk-size
+        # bytes, at boundaries which operation regexes cannot match across
+        # (see _find_window_end()). A UTF-8 sequence is never split.
+        # Yield (text, patch) tuples: text is written unchanged if patch is
+        # false.
+        #
+        # A window ending inside a C comment or inside a subscript is
+        # extended to the next boundary, up to max_extension bytes. Then the
+        # window is cut anyway, and the end of the comment is not patched.
+        chunk_size = self.args.chunk_size
+        max_extension = max(chunk_size * WINDOW_MAX_EXTENSION,
+                            WINDOW_MIN_EXTENSION)
+        size = len(data)
+        start = 0
+        in_comment = False
+        warned = False
+        while start < size:
+            if in_comment:
+                # The previous window was cut inside a C comment
+                end = data.find(b'*/', start)
+                end = size if end < 0 else end + 2
+                while start < end:
+                    stop = min(start + chunk_size, end)
+                    yield (data[start:stop].decode("utf-8", "surrogateescape"),
+                           False)
+                    start = stop
+                in_comment = False
+                continue
+
+            parts = []
+            length = 0
+            # Index in the window of an unterminated C comment, or None
+            comment = None
+            # Number of "[" without "]": EXPR_REGEX can match newlines in
+            # the subscript of "array[index]"
+            brackets = 0
+            end = self._find_window_end(data, start + chunk_size)
+            limit = end + max_extension
+            pos = start
+            while True:
+                part = data[pos:end].decode("utf-8", "surrogateescape")
+                state, brackets = self._scan_window_part(
+                    part, comment is not None, brackets)
+                if state is None:
+                    comment = None
+                elif state >= 0:
+                    comment = length + state
+                parts.append(part)
+                length += len(part)
+                if end >= size or (comment is None and brackets <= 0):
+                    break
+                if end >= limit:
+                    if not warned:
+                        self.warning(f"{filename}: cut a window inside a "
+                                     f"comment or a subscript")
+                        warned = True
+                    break
+                pos = end
+                end = self._find_window_end(data, end)
+            window = ''.join(parts)
+            if comment is not None:
+                if comment:
+                    yield (window[:comment], True)
+                yield (window[comment:], False)
+                in_comment = True
+            else:
+                yield (window, True)
+            start = end
+
+    @staticmethod
+    def _scan_window_part(part, in_comment, brackets):
+        # Scan the next part of a window. Return (state, brackets): state is
+        # None if part doesn't end inside a C comment, -1 if it ends inside
+        # the comment of the previous part, or the index in part of an
+        # unterminated C comment. brackets is the updated number of "["
+        # without "]" outside literals.
+        pos = 0
+        if in_comment:
+            pos = part.find('*/')
+            if pos < 0:
+                return (-1, brackets)
+            pos += 2
+        for match in LITERAL_REGEX.finditer(part, pos):
+            code = part[pos:match.start()]
+            comment = code.find('/*')
+            if comment >= 0:
+                # LITERAL_REGEX doesn't match an unterminated C comment
+                code = code[:comment]
+                brackets += code.count('[') - code.count(']')
+                return (pos + comment, brackets)
+            brackets += code.count('[') - code.count(']')
+            pos = match.end()
+        code = part[pos:]
+        comment = code.find('/*')
+        if comment >= 0:
+            code = code[:comment]
+        brackets += code.count('[') - code.count(']')
+        return (None if comment < 0 else pos + comment, brackets)
+
+    @staticmethod
+    def _find_window_end(data, pos):
+        # Find a window end after pos: after a newline followed by an empty
+        # line. Regexes only match empty lines with "\s" before "=" and ";"
+        # (ex: "Py_INCREF(x)\s*;"), so the next non-space character must
+        # not be "=" or ";".
+        size = len(data)
+        while pos < size:
+            ends = [index for index in (data.find(b'\n\n', pos),
+                                        data.find(b'\n\r\n', pos))
+                    if index >= 0]
+            if not ends:
+                break
+            end = min(ends) + 1
+            pos = end
+            while pos < size and data[pos:pos + 1] in b' \t\f\v\r\n':
+                pos += 1
+            if data[pos:pos + 1] not in (b'=', b';'):
+                return end
+        return size
+
+    def _patch_large_file(self, filename):
+        # Patch a large file without loading it in memory: the file is
+        # memory-mapped and patched window by window into a temporary file,
+        # so the memory usage is bounded by the window size.
+        with open(filename, "rb") as fp:
+            with mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ) as data:
+                content_hash = None
+                if self._cache_clean is not None:
+                    content_hash = hashlib.sha256(data).hexdigest()
+                    if content_hash in self._cache_clean:
+                        self._cache_seen.add(content_hash)
+                        return False
+
+                has = (self.args.no_compat
+                       or data.find(INCLUDE_PYTHONCAPI_COMPAT.encode()) >= 0
+                       or data.find(INCLUDE_PYTHONCAPI_COMPAT2.encode()) >= 0)
+                # Replace the target of a symbolic link, not the link
+                real_filename = os.path.realpath(filename)
+                fd, tmp_filename = self._create_temp_file(real_filename)
+                try:
+                    with open(fd, "wb") as tmp:
+                        operations, newline = self._patch_windows(
+                            filename, data, has, tmp)
+                    if not operations:
+                        os.unlink(tmp_filename)
+                        if content_hash is not None:
+                            self._cache_seen.add(content_hash)
+                        return False
+
+                    if self._pythoncapi_compat_needed:
+                        tmp_filename = self._prepend_include(tmp_filename,
+                                                             newline)
+                        self.pythoncapi_compat_added += 1
+                    self._replace_file(real_filename, tmp_filename)
+                except FileTimeout:
+                    os.unlink(tmp_filename)
+                    self._timeout_warning(filename)
+                    return False
+                except BaseException:
+                    with contextlib.suppress(FileNotFoundError):
+                        os.unlink(tmp_filename)
+                    raise
+                finally:
+                    self._defer_pythoncapi_compat = False
+                    self._pythoncapi_compat_needed = False
 
         self.applied_operations |= set(operations)
         operations = ', '.join(operations)
         self.log(f"Patched file: {filename} ({operations})")
         return True
 
+    def _patch_windows(self, filename, data, has_pythoncapi_compat, tmp):
+        # Write patched windows into tmp. Return (operations, newline):
+        # operations is empty if the file is left unchanged.
+        self._defer_pythoncapi_compat = True
+        self._pythoncapi_compat_needed = False
+        applied = set()
+        newline = None
+        with self._time_budget():
+            for window, patch in self._iter_windows(data, filename):
+                if newline is None:
+                    newline = self._get_newline(window)
+                if patch:
+                    window, operations = self._patch(window,
+                                                     has_pythoncapi_compat)
+                    applied.update(operations)
+                tmp.write(window.encode("utf-8", "surrogateescape"))
+        operations = [operation.NAME for operation in self.operations
+                      if operation.NAME in applied]
+        return (operations, newline)
+
+    @staticmethod
+    def _prepend_include(filename, newline):
+        # Return the name of a copy of filename starting with the include
+        tmp_filename = filename + ".include"
+        line = INCLUDE_PYTHONCAPI_COMPAT + newline + newline
+        try:
+            with open(tmp_filename, "wb") as dst:
+                dst.write(line.encode())
+                with open(filename, "rb") as src:
+                    shutil.copyfileobj(src, dst)
+        except BaseException:
+            with contextlib.suppress(FileNotFoundError):
+                os.unlink(tmp_filename)
+            raise
+        os.unlink(filename)
+        return tmp_filename
+
+    @contextlib.contextmanager
+    def _time_budget(self):
+        # Raise FileTimeout if the block takes longer than --timeout. The
+        # regular expression engine checks for signals, so a slow regex is
+        # interrupted. Only supported in the main thread on Unix.
+        timeout = self.args.timeout
+        if (not timeout
+                or not hasattr(signal, 'setitimer')
+                or threading.current_thread() is not threading.main_thread()):
+            yield
+            return
+
+        def handler(signum, frame):
+            raise FileTimeout
+
+        old_handler = signal.signal(signal.SIGALRM, handler)
+        signal.setitimer(signal.ITIMER_REAL, timeout)
+        try:
+            yield
+        finally:
+            signal.setitimer(signal.ITIMER_REAL, 0)
+            signal.signal(signal.SIGALRM, old_handler)
+
     def _walk_dir(self, path):
         empty = True
 
@@ -662,6 +1266,233 @@ class Patcher:
                 self.warning(f"Path {path} does not exist")
                 self.exitcode = 1
 
+    def _filter_filenames(self, filenames):
+        for filename in filenames:
+            if not filename or not is_c_filename(filename):
+                continue
+            if not os.path.exists(filename):
+                self.warning(f"Path {filename} does not exist")
+                self.exitcode = 1
+                continue
+            yield filename
+
+    def git_changed_files(self, revision, paths):
+        # Deleted files are excluded. Paths are relative to the current
+        # directory.
+        cmd = ["git", "diff", "--name-only", "-z", "--relative",
+               "--diff-filter=d", revision, "--"]
+        cmd.extend(paths)
+        try:
+            proc = subprocess.run(cmd, stdout=subprocess.PIPE,
+                                  stderr=subprocess.PIPE)
+        except OSError as exc:
+            self.warning(f"Failed to run git: {exc}")
+            self.exitcode = 1
+            return
+        if proc.returncode:
+            stderr = os.fsdecode(proc.stderr).strip()
+            self.warning(f"git diff {revision} failed: {stderr}")
+            self.exitcode = 1
+            return
+
+        filenames = (os.fsdecode(name) for name in proc.stdout.split(b'\0'))
+        yield from self._filter_filenames(filenames)
+
+    def read_files_from(self, path, null):
+        if path == "-":
+            data = sys.stdin.buffer.read()
+        else:
+            with open(path, "rb") as fp:
+                data = fp.read()
+        if null:
+            names = data.split(b'\0')
+        else:
+            names = data.splitlines()
+        filenames = (os.fsdecode(name) for name in names)
+        yield from self._filter_filenames(filenames)
+
+    def get_filenames(self):
+        args = self.args
+        if args.git_diff:
+            return self.git_changed_files(args.git_diff, args.paths)
+        if args.files_from:
+            return self.read_files_from(args.files_from, args.null)
+        return self.walk(args.paths)
+
+    def patch_files(self, filenames):
+        jobs = self.args.jobs
+        # Files written into stdout must not be interleaved
+        if jobs == 1 or self.args.to_stdout:
+            for filename in filenames:
+                self.patch_file(filename)
+            return
+
+        for result in self._imap_jobs(_patch_file_worker, filenames):
+            (messages, operations, compat_added, exitcode, cache_seen,
+             fsync_dirs) = result
+            for msg in messages:
+                self.log(msg)
+            self.applied_operations |= operations
+            self.pythoncapi_compat_added += compat_added
+            self.exitcode = max(self.exitcode, exitcode)
+            self._cache_seen |= cache_seen
+            self._fsync_dirs |= fsync_dirs
+
+    def _collect_filenames(self, filenames):
+        # Consume the filenames iterator in the main thread. Return
+        # (items, trailing): items is a list of (filename, messages) where
+        # messages were logged by the iterator (ex: walk() warnings) before
+        # filename, and trailing are the messages logged after the last
+        # filename.
+        old_messages = self._log_messages
+        self._log_messages = messages = []
+        items = []
+        try:
+            for filename in filenames:
+                items.append((filename, messages))
+                self._log_messages = messages = []
+        finally:
+            self._log_messages = old_messages
+        return (items, messages)
+
+    def _imap_jobs(self, worker, filenames):
+        # Call worker(filename) in worker processes and yield results in the
+        # order of filenames. Messages logged while iterating on filenames
+        # are logged at the same place as in sequential mode.
+        items, trailing = self._collect_filenames(filenames)
+        with multiprocessing.Pool(self.args.jobs, _init_worker,
+                                  (self._argv, self._cache_clean)) as pool:
+            # imap() returns results in the order of filenames
+            results = pool.imap(worker, [filename for filename, _ in items],
+                                chunksize=JOBS_CHUNKSIZE)
+            for (filename, messages), result in zip(items, results):
+                for msg in messages:
+                    self.log(msg)
+                yield result
+        for msg in trailing:
+            self.log(msg)
+
+    def count_files(self, filenames):
+        # --stats: return the JSON report
+        files = {}
+        totals = {operation.NAME: 0 for operation in self.operations}
+        scanned = 0
+
+        if self.args.jobs == 1:
+            results = ((filename, self.count_file(filename))
+                       for filename in filenames)
+        else:
+            results = self._count_files_jobs(filenames)
+
+        for filename, counts in results:
+            if counts is None:
+                continue
+            scanned += 1
+            if counts:
+                files[filename] = counts
+            for name, count in counts.items():
+                totals[name] += count
+
+        return {
+            "scanned_files": scanned,
+            "files": files,
+            "operations": totals,
+        }
+
+    def _count_files_jobs(self, filenames):
+        results = self._imap_jobs(_count_file_worker, filenames)
+        for filename, messages, counts, exitcode in results:
+            for msg in messages:
+                self.log(msg)
+            self.exitcode = max(self.exitcode, exitcode)
+            yield (filename, counts)
+
+    def _get_cache_config(self):
+        # The cache is invalidated if the script or options affecting the
+        # result change
+        with open(__file__, "rb") as fp:
+            script_hash = hashlib.sha256(fp.read()).hexdigest()
+        names = [operation.NAME for operation in self.operations]
+        return [CACHE_VERSION, script_hash, names, self.args.no_compat]
+
+    def _read_cache(self, warn=True):
+        # Return (clean, roots): roots is None if unknown
+        filename = self.args.cache
+        try:
+            with open(filename, encoding="utf-8") as fp:
+                data = json.load(fp)
+        except FileNotFoundError:
+            return (set(), [])
+        except (OSError, ValueError) as exc:
+            if warn:
+                self.warning(f"Ignore invalid cache {filename}: {exc}")
+            return (set(), [])
+
+        if (not isinstance(data, dict)
+                or data.get("config") != self._get_cache_config()):
+            return (set(), [])
+        return (set(data.get("clean", ())), data.get("roots"))
+
+    def _load_cache(self):
+        self._cache_clean = self._read_cache()[0]
+
+    def _get_cache_roots(self):
+        # Paths walked by the run, or None if only some files are checked
+        if self.args.git_diff or self.args.files_from:
+            return None
+        return sorted(set(os.path.abspath(path) for path in self.args.paths))
+
+    @staticmethod
+    def _covers_roots(roots, old_roots):
+        # Check if roots contain all old_roots
+        return all(any(old == root or old.startswith(root + os.sep)
+                       for root in roots)
+                   for old in old_roots)
+
+    def _save_cache(self):
+        roots = self._get_cache_roots()
+        # Read the cache again: another run can have added hashes since
+        # _load_cache()
+        old_clean, old_roots = self._read_cache(warn=False)
+        if (roots is not None and old_roots is not None
+                and self._covers_roots(roots, old_roots)):
+            # The run checked all files of the cache: only keep hashes of
+            # files seen by this run, so that hashes of removed or modified
+            # files don't accumulate
+            clean = set(self._cache_seen)
+        else:
+            # Other files were not checked: keep their hashes
+            clean = old_clean | self._cache_seen
+            if roots is None:
+                roots = old_roots
+            elif old_roots is None:
+                # Unknown roots: never prune
+                roots = None
+            else:
+                roots = sorted(set(roots) | set(old_roots))
+        if clean == old_clean and roots == old_roots:
+            return
+        data = {
+            "config": self._get_cache_config(),
+            "roots": roots,
+            "clean": sorted(clean),
+        }
+        # Use a unique temporary file: concurrent runs don't write into the
+        # same temporary file
+        filename = self.args.cache
+        dirname = os.path.dirname(filename) or os.curdir
+        prefix = os.path.basename(filename) + "."
+        fd, tmp_filename = tempfile.mkstemp(dir=dirname, prefix=prefix,
+                                            suffix=".tmp")
+        try:
+            with open(fd, "w", encoding="utf-8") as fp:
+                json.dump(data, fp)
+            os.replace(tmp_filename, filename)
+        except BaseException:
+            with contextlib.suppress(FileNotFoundError):
+                os.unlink(tmp_filename)
+            raise
+
     def get_latest_header(self, base_dir):
         target = os.path.join(base_dir, PYTHONCAPI_COMPAT_H)
         self.log(f"Download the file from {PYTHONCAPI_COMPAT_URL} to {target}.")
@@ -680,6 +1511,17 @@ class Patcher:
         print("If a directory is passed, search for .c and .h files "
               "in subdirectories.")
 
+    def _parse_jobs(self, value):
+        try:
+            jobs = int(value)
+        except ValueError:
+            jobs = -1
+        if jobs < 0:
+            raise argparse.ArgumentTypeError(f"invalid number of jobs: {value}")
+        if jobs == 0:
+            jobs = os.cpu_count() or 1
+        return jobs
+
     def _parse_dir_path(self, path):
         if os.path.isdir(path):
             return path
@@ -710,24 +1552,81 @@ class Patcher:
             '-d', '--download', metavar='PATH',
             help=f'Download latest pythoncapi_compat.h file to designated PATH',
             type=self._parse_dir_path)
+        parser.add_argument(
+            '--git-diff', metavar='REVISION',
+            help="Only patch C files changed relative to a git revision, "
+                 "in the specified paths if any")
+        parser.add_argument(
+            '--files-from', metavar='FILE',
+            help="Read the list of files to patch from FILE, one per line, "
+                 "or from stdin if FILE is '-'")
+        parser.add_argument(
+            '-0', '--null', action="store_true",
+            help="--files-from: filenames are separated by NUL characters")
+        parser.add_argument(
+            '--cache', metavar='FILE',
+            help="Cache file: skip files which are known to not need "
+                 "to be patched")
+        parser.add_argument(
+            '--timeout', metavar='SECONDS', type=float, default=0,
+            help="Skip files which take longer than SECONDS to patch "
+                 "(default: no timeout)")
+        parser.add_argument(
+            '--chunk-size', metavar='BYTES', type=int,
+            default=DEFAULT_CHUNK_SIZE,
+            help="Memory-map files larger than BYTES and patch them by "
+                 "windows of about BYTES bytes, to bound the memory usage "
+                 "(0: disable, default: %(default)s)")
+        parser.add_argument(
+            '--fsync', action="store_true",
+            help="Flush patched files on disk before replacing them, and "
+                 "flush their directories once at exit")
+        parser.add_argument(
+            '--stats', action="store_true",
+            help="Don't modify files: count matches per operation and "
+                 "file, and write a JSON report into stdout")
+        parser.add_argument(
+            '-j', '--jobs', metavar='N', default=1,
+            type=self._parse_jobs,
+            help='Patch files in N worker processes '
+                 '(0: number of CPUs, default: 1)')
         parser.add_argument(
             metavar='file_or_directory', dest="paths", nargs='*')
 
         args = parser.parse_args(args)
-        if not args.paths and not args.download:
+        if args.git_diff and args.files_from:
+            parser.error("--git-diff and --files-from are incompatible")
+        if args.files_from and args.paths:
+            parser.error("--files-from and paths are incompatible")
+        if (not args.paths and not args.download
+                and not args.git_diff and not args.files_from):
             self.usage(parser)
             sys.exit(1)
 
+        if args.stats and args.to_stdout:
+            parser.error("--stats and --to-stdout are incompatible")
+        if args.chunk_size < 0:
+            parser.error("--chunk-size must be >= 0")
         if args.to_stdout:
             args.quiet = True
 
         self.args = args
         self.operations = self._get_operations(parser)
+        self._compile_prefilter()
 
     def main(self):
-        if self.args.paths:
-            for filename in self.walk(self.args.paths):
-                self.patch_file(filename)
+        if self.args.paths or self.args.git_diff or self.args.files_from:
+            if self.args.cache:
+                self._load_cache()
+            if self.args.stats:
+                report = self.count_files(self.get_filenames())
+                json.dump(report, sys.stdout, indent=2)
+                print()
+            else:
+                self.patch_files(self.get_filenames())
+                self.sync_dirs()
+                if self.args.cache:
+                    self._save_cache()
 
         if self.applied_operations:
             nops = len(self.applied_operations)
@@ -748,5 +1647,49 @@ class Patcher:
         sys.exit(self.exitcode)
 
 
+# Number of files sent at once to a worker process by Patcher.patch_files()
+JOBS_CHUNKSIZE = 16
+
+# Patcher of a worker process, created by _init_worker()
+_worker_patcher = None
+
+
+def _init_worker(argv, cache_clean):
+    global _worker_patcher
+    _worker_patcher = Patcher(argv)
+    _worker_patcher._cache_clean = cache_clean
+
+
+def _patch_file_worker(filename):
+    # Patch a file in a worker process and return what the parent process
+    # needs to log messages and to compute the summary and the exit code.
+    patcher = _worker_patcher
+    patcher.applied_operations = set()
+    patcher.pythoncapi_compat_added = 0
+    patcher.exitcode = 0
+    patcher._cache_seen = set()
+    patcher._fsync_dirs = set()
+    patcher._log_messages = []
+    try:
+        patcher.patch_file(filename)
+        return (patcher._log_messages, patcher.applied_operations,
+                patcher.pythoncapi_compat_added, patcher.exitcode,
+                patcher._cache_seen, patcher._fsync_dirs)
+    finally:
+        patcher._log_messages = None
+
+
+def _count_file_worker(filename):
+    # Count matches of a file in a worker process (--stats)
+    patcher = _worker_patcher
+    patcher.exitcode = 0
+    patcher._log_messages = []
+    try:
+        counts = patcher.count_file(filename)
+        return (filename, patcher._log_messages, counts, patcher.exitcode)
+    finally:
+        patcher._log_messages = None
+
+
 if __name__ == "__main__":
     Patcher().main()